@@ -1,34 +1,84 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE		// sched_getaffinity, CPU_COUNT
 
-#include <stdio.h>		// dprintf, ssize_t, off_t
-#include <unistd.h>		// STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO
-#include <fcntl.h>		// open, close
+#include <stdio.h>		// dprintf, fopen, fscanf, ssize_t, off_t
+#include <unistd.h>		// STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, pwrite
+#include <fcntl.h>		// open, close, posix_fallocate, vmsplice
 #include <sys/stat.h>		// struct stat, fstat
+#include <sys/mman.h>		// mmap, munmap, posix_madvise
+#include <sys/uio.h>		// struct iovec
 
 #include <stdbool.h>		// bool
 #include <string.h>		// strcmp, memcpy
-#include <stdint.h>		// uint8_t, UINT8_MAX
-#include <stdlib.h>		// EXIT_SUCCESS, NULL, strtol, strtoll, size_t, exit
+#include <strings.h>		// strcasecmp
+#include <libgen.h>		// basename
+#include <limits.h>		// LLONG_MAX, UINT_MAX
+#include <stdint.h>		// uint8_t, UINT16_MAX
+#include <stdlib.h>		// EXIT_SUCCESS, NULL, strtoll, size_t, exit
 
 #include <err.h>		// err, errx, warn, warnx
 #include <errno.h>		// errno, ERANGE, EINVAL
 
 #include <getopt.h>		// getopt_long, struct option
 
+#include <pthread.h>		// pthread_create, pthread_join, pthread_cond_*
+#include <sched.h>		// sched_getaffinity, sched_yield, CPU_COUNT
+#include <stdatomic.h>		// atomic_*
+
+#ifdef __linux__
+#include <sys/syscall.h>	// __NR_io_uring_*
+#endif
+#if defined(__NR_io_uring_setup) && __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>	// struct io_uring_*, IORING_*
+#endif
+
+#include "bin2mif.h"
+
 //////////////////////////////////// Typedefs /////////////////////////////////
 
 typedef uint8_t byte;
 
 /////////////////////////////////// Constants /////////////////////////////////
 
-#define INPUT_BUFFER_SIZE 128	// words
+#define INPUT_BUFFER_SIZE (1 << 20)	// bytes read at once
+#define OUTPUT_BUFFER_SIZE (1 << 20)	// bytes
+#define PIPE_BUFFER_SIZE (1 << 20)	// bytes of capacity asked of pipes
+#define CHUNK_SIZE (4 << 20)	// bytes of records formatted per parallel task
+#define DECODE_BLOCK_SIZE (64 << 10)	// bytes of words decoded before bit-packing
+#define BUFFER_ALIGNMENT 64	// bytes; a cache line and the widest vector
+#define PIPELINE_SLOTS 4	// buffers in each pipeline ring
+#define PIPELINE_BLOCK_SIZE (1 << 20)	// bytes read into one ring buffer
+#define SPIN_LIMIT 64		// polls before a waiting thread sleeps
 
 static const char *HELP_MESSAGE =
     "Usage: bin2mif [OPTIONS] [in_file]\n"
-    "-w, --width <WIDTH>\thas to be a multiple of 8\t\t(default is 8 bits)\n"
+    "       bin2mif [OPTIONS] --batch <JOBFILE>\n"
+    "       mif2bin [-o FILE] [-b ORDER] [-j N] [in_file]\n"
+    "-w, --width <WIDTH>\tbits per word\t\t\t\t(default is 8 bits)\n"
+    "\t\t\tinput words that are not whole bytes are bit-packed\n"
     "-d, --depth <DEPTH>\tnumber of words, each <WIDTH> bits wide"
-    "\t(default is the input file size)\n"
+    "\t(default is the input size)\n"
     "-o, --output <FILE>\twrite output to file\t\t\t(default is stdout)\n"
+    "-A, --address-radix <RADIX>\tBIN, OCT, DEC, UNS or HEX"
+    "\t(default is HEX)\n"
+    "-D, --data-radix <RADIX>\tBIN, OCT, DEC, UNS or HEX"
+    "\t(default is HEX)\n"
+    "-l, --words-per-line <N>\tvalues per record"
+    "\t\t(default is 1)\n"
+    "-b, --byte-order <ORDER>\tlittle, big, word-swapped or"
+    " half-word-swapped\n"
+    "\t\t\tbyte order of the binary words\t\t(default is little)\n"
+    "-c, --compress\t\tcollapse runs of equal words into"
+    " [a..b] ranges\n"
+    "-j, --jobs <N>\t\tformat on N threads\t\t\t"
+    "(default is the available CPU count)\n"
+    "-r, --reverse\t\tconvert a .mif file back to binary"
+    "\t(default when run as mif2bin)\n"
+    "-U, --io-uring\t\tread and write streams through io_uring"
+    " if the kernel has it\n"
+    "-B, --batch <JOBFILE>\tconvert the files listed in JOBFILE on N threads\n"
+    "\t\t\tone \"<in_file> <out_file> <depth> <width>\" per line,"
+    " depth - for the whole file\n"
     "-h, --help\t\tview this message\n";
 
 static struct option LONG_OPTIONS[] = {
@@ -36,11 +86,20 @@ static struct option LONG_OPTIONS[] = {
 	{"width", required_argument, NULL, 'w'},
 	{"depth", required_argument, NULL, 'd'},
 	{"output", required_argument, NULL, 'o'},
+	{"address-radix", required_argument, NULL, 'A'},
+	{"data-radix", required_argument, NULL, 'D'},
+	{"words-per-line", required_argument, NULL, 'l'},
+	{"byte-order", required_argument, NULL, 'b'},
+	{"compress", no_argument, NULL, 'c'},
+	{"jobs", required_argument, NULL, 'j'},
+	{"reverse", no_argument, NULL, 'r'},
+	{"io-uring", no_argument, NULL, 'U'},
+	{"batch", required_argument, NULL, 'B'},
 	{"help", no_argument, NULL, 'h'},
 	{NULL, 0, NULL, 0}
 };
 
-static const char *OPTSTRING = "w:d:o:h";
+static const char *OPTSTRING = "w:d:o:A:D:l:b:cj:rUB:h";
 
 //////////////////////////////////// Errors ///////////////////////////////////
 
@@ -66,21 +125,23 @@ static const char *ERROR_MSG[] = {
 
 ////////////////////////////////// Utilities //////////////////////////////////
 
-byte str_to_byte(const char *str)
+unsigned int str_to_uint(const char *str)
 {
+	errno = 0;
+
 	char *end = NULL;
-	long num = strtol(str, &end, 10);
+	long long num = strtoll(str, &end, 10);
 
 	if (*end != '\0') {
 		errno = EINVAL;
-		return -1;
+		return 0;
 	}
-	if (num < 0 || num > UINT8_MAX) {
+	if (errno == ERANGE || num < 0 || num > UINT_MAX) {
 		errno = ERANGE;
-		return -1;
+		return 0;
 	}
 
-	return (byte) num;
+	return (unsigned int)num;
 }
 
 long long str_to_ll(const char *str)
@@ -101,6 +162,41 @@ long long str_to_ll(const char *str)
 	return num;
 }
 
+/*
+* Parse a radix name, in any case; return -1 with errno EINVAL if unknown
+*/
+int str_to_radix(const char *str)
+{
+	static const char *NAMES[] = { "BIN", "OCT", "DEC", "UNS", "HEX" };
+
+	for (int radix = MIF_RADIX_BIN; radix <= MIF_RADIX_HEX; ++radix) {
+		if (strcasecmp(str, NAMES[radix]) == 0) {
+			return radix;
+		}
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+* Parse a byte order name, in any case; return -1 with errno EINVAL if unknown
+*/
+int str_to_byte_order(const char *str)
+{
+	static const char *NAMES[] = {
+		"little", "big", "word-swapped", "half-word-swapped"
+	};
+
+	for (int order = MIF_ORDER_LITTLE;
+	     order <= MIF_ORDER_HALF_WORD_SWAPPED; ++order) {
+		if (strcasecmp(str, NAMES[order]) == 0) {
+			return order;
+		}
+	}
+	errno = EINVAL;
+	return -1;
+}
+
 static inline bool safe_close(int *fd)
 {
 	if (fd == NULL || *fd == -1) {
@@ -112,38 +208,136 @@ static inline bool safe_close(int *fd)
 	return retval;
 }
 
-ssize_t read_aligned(int fd, void *dest, size_t nwords, byte word_size,
-		     void *put_aside, byte *remainder_len)
+/*
+* Read whole words into <dest>, keeping a trailing partial word in <put_aside>
+* for the next call. Blocks until at least one word is available; returns 0
+* only at EOF.
+*/
+ssize_t read_aligned(int fd, void *dest, size_t nwords, size_t word_size,
+		     void *put_aside, size_t *remainder_len)
 {
+	byte *ptr = dest;
 	size_t nbytes = nwords * word_size;
+	size_t bytes_read = *remainder_len;
 
-	if (put_aside != NULL && remainder_len != NULL && *remainder_len > 0) {
-		memcpy(dest, put_aside, *remainder_len);
-		dest += *remainder_len;
-	}
-
-	ssize_t bytes_read = read(fd, dest, nbytes - *remainder_len);
-	if (bytes_read < 0) {
-		return -1;
+	memcpy(ptr, put_aside, *remainder_len);
+	while (bytes_read < word_size) {
+		ssize_t chunk = read(fd, ptr + bytes_read, nbytes - bytes_read);
+		if (chunk < 0 && errno == EINTR) {
+			continue;
+		}
+		if (chunk < 0) {
+			return -1;
+		}
+		if (chunk == 0) {
+			break;
+		}
+		bytes_read += chunk;
 	}
-	bytes_read += *remainder_len;
 
 	ssize_t words_read = bytes_read / word_size;
 	*remainder_len = bytes_read % word_size;
 
-	memcpy(dest + nbytes - *remainder_len, put_aside, *remainder_len);
+	memcpy(put_aside, ptr + words_read * word_size, *remainder_len);
 	return words_read;
 }
 
-unsigned int num_len(unsigned long long num, byte base)
+/*
+* Write the whole buffer, retrying on short writes and interrupts
+*/
+bool write_all(int fd, const void *src, size_t nbytes)
+{
+	const char *ptr = src;
+	while (nbytes > 0) {
+		ssize_t written = write(fd, ptr, nbytes);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		ptr += written;
+		nbytes -= written;
+	}
+	return true;
+}
+
+bool pwrite_all(int fd, const void *src, size_t nbytes, off_t offset)
+{
+	const char *ptr = src;
+	while (nbytes > 0) {
+		ssize_t written = pwrite(fd, ptr, nbytes, offset);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		ptr += written;
+		offset += written;
+		nbytes -= written;
+	}
+	return true;
+}
+
+/*
+* Allocate <size> bytes aligned to BUFFER_ALIGNMENT; release with free
+*/
+void *alloc_aligned(size_t size)
 {
-	unsigned int len = 1;
-	num /= base;
-	while (num > 0) {
-		num /= base;
-		++len;
+	void *ptr = NULL;
+	int error = posix_memalign(&ptr, BUFFER_ALIGNMENT, size);
+	if (error != 0) {
+		errno = error;
+		return NULL;
+	}
+	return ptr;
+}
+
+/*
+* Allocate <size> bytes of fresh anonymous pages, or NULL; release with
+* free_pages. Unlike heap memory, released pages are never handed out again
+* while a pipe still references them.
+*/
+void *alloc_pages(size_t size)
+{
+	void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return (ptr != MAP_FAILED ? ptr : NULL);
+}
+
+void free_pages(void *ptr, size_t size)
+{
+	if (ptr != NULL) {
+		(void)munmap(ptr, size);
+	}
+}
+
+/*
+* Open <filename> for output, truncated. A regular file is reopened with read
+* access too when allowed, so it can be memory-mapped; FIFOs and devices stay
+* write-only, as holding their read end would hide a reader that went away.
+*/
+int open_output(const char *filename)
+{
+	int fd = open(filename, O_WRONLY | O_TRUNC | O_CREAT, 0666);
+	struct stat wr_stat;
+	if (fd < 0 || fstat(fd, &wr_stat) != 0 || !S_ISREG(wr_stat.st_mode)) {
+		return fd;
+	}
+
+	int rw_fd = open(filename, O_RDWR);
+	struct stat rw_stat;
+	if (rw_fd >= 0 && fstat(rw_fd, &rw_stat) == 0
+	    && rw_stat.st_dev == wr_stat.st_dev
+	    && rw_stat.st_ino == wr_stat.st_ino) {
+		(void)safe_close(&fd);
+		return rw_fd;
+	}
+	if (rw_fd >= 0) {	// replaced in between: keep the one truncated
+		(void)safe_close(&rw_fd);
 	}
-	return len;
+	return fd;
 }
 
 /*
@@ -165,195 +359,2931 @@ off_t file_size(int fd)
 	return file_stat.st_size;
 }
 
-////////////////////////////////// Generator //////////////////////////////////
-
-static inline bool generate_mif_header(int out_fd, long long depth, byte width)
+/*
+* True if output may be placed at explicit offsets of <fd>: a regular file
+* not opened for appending, where the offsets would be ignored
+*/
+bool positional_output(int fd)
 {
-	static const char *ADDRESS_RADIX = "HEX";
-	static const char *DATA_RADIX = "HEX";
-
-	return (dprintf(out_fd, "DEPTH = %lld;\n"
-			"WIDTH = %d;\n"
-			"ADDRESS_RADIX = %s;\n"
-			"DATA_RADIX = %s;\n"
-			"CONTENT\n"
-			"BEGIN\n",
-			depth, width, ADDRESS_RADIX, DATA_RADIX) > 0);
+	int flags = fcntl(fd, F_GETFL);
+	return (file_size(fd) >= 0 && flags != -1 && (flags & O_APPEND) == 0);
 }
 
-long long generate_mif_content(int in_fd, int out_fd, long long depth,
-			       byte width)
-{
-	const byte word_size = width / 8;
-	// const size_t buffer_size = INPUT_BUFFER_SIZE * word_size;
-	const unsigned int addr_repr_width = num_len(depth - 1, 16);
+//////////////////////////////////// Pipes ////////////////////////////////////
 
-	byte buffer[INPUT_BUFFER_SIZE][word_size];
-	ssize_t words_read = 0;
+/*
+* Pipes are grown to PIPE_BUFFER_SIZE so that each read and write moves more
+* data. Buffers of at least the pipe's capacity are handed to the reader with
+* vmsplice instead of being copied. The pipe then references their pages until
+* they are read, so a spliced buffer is only reused once a later one has been
+* spliced: the pipe cannot hold both. (A reader that splices the pages on
+* into another pipe may still see them change.)
+*/
+
+#ifdef F_SETPIPE_SZ
+
+/*
+* If <fd> is a pipe, grow it to PIPE_BUFFER_SIZE bytes, or as close as the
+* system allows, and return its capacity; return 0 for any other file
+*/
+size_t pipe_grow(int fd)
+{
+	struct stat fd_stat;
+	if (fstat(fd, &fd_stat) == -1 || !S_ISFIFO(fd_stat.st_mode)) {
+		return 0;
+	}
 
-	byte put_aside_buffer[word_size];
-	byte remainder_len = 0;
+	int capacity = fcntl(fd, F_GETPIPE_SZ);
+	if (capacity < 0) {
+		return 0;
+	}
+	for (int want = PIPE_BUFFER_SIZE; want > capacity; want /= 2) {
+		int grown = fcntl(fd, F_SETPIPE_SZ, want);
+		if (grown >= 0) {
+			capacity = grown;
+			break;
+		}
+	}
+	return capacity;
+}
 
-	size_t word_idx = 0;
-	for (long long addr = 0; addr < depth; ++addr) {
-		if (words_read == 0) {
-			word_idx = 0;
-			words_read =
-			    read_aligned(in_fd, buffer, INPUT_BUFFER_SIZE,
-					 word_size, put_aside_buffer,
-					 &remainder_len);
-			if (words_read < 0) {
-				warn("reading binary words from file");
-				return addr;
+/*
+* Hand the whole buffer to the pipe <fd> by reference, retrying on short
+* splices and interrupts
+*/
+bool splice_all(int fd, const void *src, size_t nbytes)
+{
+	struct iovec iov = { .iov_base = (void *)src, .iov_len = nbytes };
+	while (iov.iov_len > 0) {
+		ssize_t spliced = vmsplice(fd, &iov, 1, 0);
+		if (spliced < 0) {
+			if (errno == EINTR) {
+				continue;
 			}
+			return false;
 		}
-		if (words_read == 0 && remainder_len == 0) {
-			warnx("unexpected EOF");
-			return addr;
+		iov.iov_base = (char *)iov.iov_base + spliced;
+		iov.iov_len -= spliced;
+	}
+	return true;
+}
+
+/*
+* Move everything left on <fd> into a new anonymous memory file and return
+* it, rewound, or -1 with errno set. Pipes are spliced into it without passing
+* through user space; other streams are copied.
+*/
+int spool_input(int fd)
+{
+	int spool = memfd_create("bin2mif-input", MFD_CLOEXEC);
+	if (spool < 0) {
+		return -1;
+	}
+	(void)pipe_grow(fd);
+
+	byte *buffer = NULL;	// the copy fallback
+	while (true) {
+		ssize_t moved;
+		if (buffer == NULL) {
+			moved = splice(fd, NULL, spool, NULL, PIPE_BUFFER_SIZE,
+				       SPLICE_F_MOVE);
+			if (moved < 0 && errno == EINVAL) {
+				if ((buffer = malloc(INPUT_BUFFER_SIZE)) == NULL) {
+					break;
+				}
+				continue;
+			}
+		} else {
+			moved = read(fd, buffer, INPUT_BUFFER_SIZE);
+			if (moved > 0 && !write_all(spool, buffer, moved)) {
+				break;
+			}
 		}
 
-		if (dprintf(out_fd, "%0*llx : ", addr_repr_width, addr) < 0) {
-			warn("writing record to output");
-			return addr;
+		if (moved == 0 && lseek(spool, 0, SEEK_SET) == 0) {
+			free(buffer);
+			return spool;
 		}
-		for (short byte_idx = word_size - 1; byte_idx >= 0; --byte_idx) {
-			if (dprintf(out_fd, byte_idx == 0 ? "%02x;\n" : "%02x",
-				    buffer[word_idx][byte_idx]) < 0) {
-				warn("writing record to output");
-				return addr;
-			}
+		if (moved < 0 && errno != EINTR) {
+			break;
 		}
-		++word_idx;
-		--words_read;
 	}
 
-	return depth;
+	int error = errno;
+	free(buffer);
+	(void)close(spool);
+	errno = error;
+	return -1;
 }
 
-long long generate_mif(int in_fd, int out_fd, long long depth, byte width)
+#else				// !F_SETPIPE_SZ
+
+size_t pipe_grow(int fd)
 {
-	const long long bytes_requested = depth * width / 8;
-	off_t in_file_size = file_size(in_fd);
+	(void)fd;
+	return 0;
+}
 
-	// Argument validation
-	if (in_file_size == -1)	// system error
-	{
-		warn("getting file size");
-		return -1;
-	}
-	if (in_file_size == -2 && depth < 0)	// reading from stdin; depth unknown
-	{
-		errno = EINVAL;
-		warn("memory depth has to be given when reading from stdin");
-		return -1;
-	}
-	if (depth < 0) {
-		depth = in_file_size / (width / 8);
-	}			// desired depth equals the file size
-	else if (in_file_size != -2 && in_file_size < bytes_requested)	// file is too short
-	{
-		warnx
-		    ("%lld bytes were requested, but the input file only contains %ld",
-		     bytes_requested, in_file_size);
+int spool_input(int fd)
+{
+	(void)fd;
+	errno = ENOSYS;
+	return -1;
+}
+
+bool splice_all(int fd, const void *src, size_t nbytes)
+{
+	return write_all(fd, src, nbytes);
+}
+
+#endif				// F_SETPIPE_SZ
+
+/*
+* Write the whole buffer to <fd>, a pipe of <capacity> bytes or 0 for any
+* other file. If the buffer is at least as large as the pipe, it is spliced
+* and true is stored to <*spliced>: the buffer must stay unchanged until a
+* later splice, and every buffer spliced before it may be reused.
+*/
+bool pipe_write(int fd, size_t capacity, const void *src, size_t nbytes,
+		bool *spliced)
+{
+	*spliced = (capacity > 0 && nbytes >= capacity);
+	return (*spliced ? splice_all(fd, src, nbytes)
+		: write_all(fd, src, nbytes));
+}
+
+//////////////////////////////////// Input ////////////////////////////////////
+
+/*
+* Binary words come either straight from a memory-mapped regular file or
+* through read_aligned into a caller-provided aligned buffer of about
+* INPUT_BUFFER_SIZE bytes. They are taken in units of whole words, or of 8
+* words (<width> bytes) when bit-packed.
+*/
+struct input {
+	int fd;
+	size_t unit_size;
+
+	const byte *map;	// NULL unless the file is mapped
+	size_t map_len;
+	size_t map_pos;
+
+	byte *buffer;		// read path: <buffer_units> units
+	size_t buffer_units;
+	byte *put_aside;	// partial unit carried over between reads
+	size_t remainder_len;
+};
+
+static inline size_t input_buffer_units(size_t unit_size)
+{
+	size_t nunits = INPUT_BUFFER_SIZE / unit_size;
+	return (nunits > 0 ? nunits : 1);
+}
+
+/*
+* Size of the buffer an input of <unit_size> units reads into
+*/
+size_t input_buffer_len(size_t unit_size)
+{
+	return (input_buffer_units(unit_size) + 1) * unit_size;
+}
+
+void input_init(struct input *in, int fd, size_t unit_size, byte *buffer)
+{
+	in->fd = fd;
+	in->unit_size = unit_size;
+	in->map = NULL;
+	in->map_len = 0;
+	in->map_pos = 0;
+	in->remainder_len = 0;
+
+	in->buffer = buffer;
+	in->buffer_units = input_buffer_units(unit_size);
+	in->put_aside = in->buffer + in->buffer_units * unit_size;
+}
+
+/*
+* Map the first <nbytes> of a regular file. On failure the input silently
+* stays on the read path.
+*/
+void input_map(struct input *in, size_t nbytes)
+{
+	if (nbytes == 0) {
+		return;
 	}
 
-	if (!generate_mif_header(out_fd, depth, width)) {
-		return -1;
+	void *map = mmap(NULL, nbytes, PROT_READ, MAP_PRIVATE, in->fd, 0);
+	if (map == MAP_FAILED) {
+		return;
 	}
+	(void)posix_madvise(map, nbytes, POSIX_MADV_SEQUENTIAL);
 
-	// Fill in the content
-	long long word_count =
-	    generate_mif_content(in_fd, out_fd, depth, width);
-	if (word_count < 0) {
-		return -1;
+	in->map = map;
+	in->map_len = nbytes;
+}
+
+/*
+* Point <*units> at up to <nunits> next whole units; fewer than a buffer's
+* worth when the input is not mapped. Return the number of units, 0 at EOF or
+* -1 on error.
+*/
+static inline ssize_t input_next(struct input *in, size_t nunits,
+				 const byte **units)
+{
+	if (in->map == NULL) {
+		if (nunits > in->buffer_units) {
+			nunits = in->buffer_units;
+		}
+		*units = in->buffer;
+		return read_aligned(in->fd, in->buffer, nunits, in->unit_size,
+				    in->put_aside, &in->remainder_len);
 	}
 
-	// End file
-	if (dprintf(out_fd, "END;\n") < 0) {
-		warn("ending .mif file");
-		return -1;
+	size_t available = (in->map_len - in->map_pos) / in->unit_size;
+	if (available < nunits) {
+		nunits = available;
 	}
 
-	return word_count;
+	*units = in->map + in->map_pos;
+	in->map_pos += nunits * in->unit_size;
+	return nunits;
 }
 
-//////////////////////////////////// Main /////////////////////////////////////
-
-int main(int argc, char *argv[])
+/*
+* Point <*tail> at the bytes left after the last whole unit at EOF and return
+* their number
+*/
+static inline size_t input_tail(struct input *in, const byte **tail)
 {
-	// Command line parameters
-	long long depth = -1;
-	byte width = 8;
-	const char *in_filename = "-";
-	const char *out_filename = NULL;
+	if (in->map == NULL) {
+		*tail = in->put_aside;
+		return in->remainder_len;
+	}
 
-	// Parse command line arguments
-	char chr = '\0';
-	while ((chr =
-		getopt_long(argc, argv, OPTSTRING, LONG_OPTIONS, NULL)) >= 0) {
-		switch (chr) {
-		case 'w':
-			width = str_to_byte(optarg);
-			if (errno != 0) {
-				err(BAD_NUMBER_FORMAT,
-				    ERROR_MSG[BAD_NUMBER_FORMAT], optarg);
-			}
-			break;
+	*tail = in->map + in->map_pos;
+	return in->map_len - in->map_pos;
+}
 
-		case 'd':
-			depth = str_to_ll(optarg);
-			if (depth < 0) {
-				err(BAD_NUMBER_FORMAT,
-				    ERROR_MSG[BAD_NUMBER_FORMAT], optarg);
-			}
-			break;
+void input_destroy(struct input *in)
+{
+	if (in->map != NULL) {
+		(void)munmap((void *)in->map, in->map_len);
+		in->map = NULL;
+	}
+}
 
-		case 'o':
-			out_filename = optarg;
-			break;
+//////////////////////////////// Output buffer ////////////////////////////////
 
-		case 'h':
-			(void)dprintf(STDERR_FILENO, HELP_MESSAGE);
-			return EXIT_SUCCESS;
+/*
+* Records are assembled in a large user-space buffer, which is handed to the
+* kernel in OUTPUT_BUFFER_SIZE chunks. Write errors surface on flush only.
+* Pipes are fed by splicing full buffers, alternating with a spare one.
+*/
+struct output_buffer {
+	int fd;
+	size_t pipe_capacity;	// 0 unless <fd> is a pipe taking splices
+	size_t len;
+	char *data;		// OUTPUT_BUFFER_SIZE bytes
+	char *spare;		// swapped in when <data> is spliced
+};
 
-		case '?':
-		default:
-			(void)dprintf(STDERR_FILENO, "\n%s", HELP_MESSAGE);
-			return INVALID_ARGUMENTS;
-		}
+/*
+* Point an empty buffer at <fd>, growing it if it is a pipe. A spare buffer
+* a previous pipe may still reference is exchanged for fresh pages.
+*/
+void output_buffer_reset(struct output_buffer *out, int fd)
+{
+	out->fd = fd;
+	out->len = 0;
+
+	free_pages(out->spare, OUTPUT_BUFFER_SIZE);
+	out->spare = NULL;
+	out->pipe_capacity = pipe_grow(fd);
+	if (out->pipe_capacity > 0
+	    && (out->spare = alloc_pages(OUTPUT_BUFFER_SIZE)) == NULL) {
+		out->pipe_capacity = 0;
 	}
+}
 
-	if (optind < argc && argc - optind == 1) {
-		in_filename = argv[optind++];
-	} else if (optind < argc) {
-		err(INVALID_ARGUMENTS, ERROR_MSG[INVALID_ARGUMENTS]);
+struct output_buffer *output_buffer_create(int fd)
+{
+	struct output_buffer *out = malloc(sizeof(struct output_buffer));
+	if (out == NULL) {
+		return NULL;
+	}
+	out->spare = NULL;
+	out->data = alloc_pages(OUTPUT_BUFFER_SIZE);
+	if (out->data == NULL) {
+		free(out);
+		return NULL;
 	}
 
-	// Open files
-	int in_fd = (strcmp(in_filename, "-") != 0 ? open(in_filename, O_RDONLY)
-		     : STDIN_FILENO);
+	output_buffer_reset(out, fd);
+	return out;
+}
 
-	if (in_fd < 0) {
-		err(FILE_OPEN_FAILURE, ERROR_MSG[FILE_OPEN_FAILURE],
-		    in_filename);
+bool output_buffer_flush(struct output_buffer *out)
+{
+	bool spliced = false;
+	bool retval = pipe_write(out->fd, out->pipe_capacity, out->data,
+				 out->len, &spliced);
+	if (spliced) {
+		char *data = out->data;
+		out->data = out->spare;
+		out->spare = data;
 	}
+	out->len = 0;
+	return retval;
+}
 
-	int out_fd = (out_filename != NULL
-		      ? open(out_filename, O_WRONLY | O_TRUNC | O_CREAT, 0666)
-		      : STDOUT_FILENO);
+/*
+* Return a pointer to at least <nbytes> of free space, flushing if needed.
+* The space is claimed with output_buffer_commit.
+*/
+static inline char *output_buffer_reserve(struct output_buffer *out,
+					  size_t nbytes)
+{
+	if (OUTPUT_BUFFER_SIZE - out->len < nbytes
+	    && !output_buffer_flush(out)) {
+		return NULL;
+	}
+	return out->data + out->len;
+}
 
-	if (out_fd < 0) {
-		int saved_errno = errno;
-		(void)safe_close(&in_fd);
+static inline void output_buffer_commit(struct output_buffer *out,
+					size_t nbytes)
+{
+	out->len += nbytes;
+}
 
-		errno = saved_errno;
-		err(FILE_OPEN_FAILURE, ERROR_MSG[FILE_OPEN_FAILURE],
-		    out_filename);
+void output_buffer_destroy(struct output_buffer *out)
+{
+	if (out != NULL) {
+		free_pages(out->data, OUTPUT_BUFFER_SIZE);
+		free_pages(out->spare, OUTPUT_BUFFER_SIZE);
 	}
+	free(out);
+}
+
+/////////////////////////////////// io_uring //////////////////////////////////
 
-	// Generate .mif file
-	long long words_written = generate_mif(in_fd, out_fd, depth, width);
-	if (words_written != depth) {
+/*
+* With -U, streamed input and output go through an io_uring, set up with raw
+* system calls: up to PIPELINE_SLOTS reads run ahead of the encoder and up to
+* PIPELINE_SLOTS writes drain behind it, from buffers registered with the
+* kernel once per thread. Reads and writes at explicit offsets are only
+* issued several at a time on regular files; on pipes and other streams,
+* one of each is in flight, so the data stays in order. Without io_uring in
+* the kernel (or the headers), the POSIX path is taken.
+*/
+#define URING_ENTRIES (4 * PIPELINE_SLOTS)	// submission queue entries
+
+struct uring {
+	int fd;
+	void *ring_map;
+	size_t ring_map_len;
+	struct io_uring_sqe *sqes;
+	size_t sqes_len;
+
+	_Atomic unsigned int *sq_head;
+	_Atomic unsigned int *sq_tail;
+	unsigned int *sq_array;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+	unsigned int sq_local_tail;	// entries prepared, not yet published
+	unsigned int unsubmitted;
+
+	_Atomic unsigned int *cq_head;
+	_Atomic unsigned int *cq_tail;
+	struct io_uring_cqe *cqes;
+	unsigned int cq_mask;
+
+	bool fixed;		// the buffers are registered
+	char *buffers;		// PIPELINE_SLOTS input, then output buffers
+};
+
+#ifdef HAVE_IO_URING
+
+void uring_destroy(struct uring *ring)
+{
+	if (ring == NULL) {
+		return;
+	}
+	if (ring->sqes != NULL) {
+		(void)munmap(ring->sqes, ring->sqes_len);
+	}
+	if (ring->ring_map != NULL) {
+		(void)munmap(ring->ring_map, ring->ring_map_len);
+	}
+	if (ring->fd >= 0) {
+		(void)close(ring->fd);
+	}
+	free(ring->buffers);
+	free(ring);
+}
+
+/*
+* Set up a ring and its buffers; return NULL if the kernel has no io_uring or
+* it cannot be set up
+*/
+struct uring *uring_create(void)
+{
+	struct uring *ring = calloc(1, sizeof(struct uring));
+	if (ring == NULL) {
+		return NULL;
+	}
+	ring->fd = -1;
+
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (ring->fd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP)
+	    || !(params.features & IORING_FEAT_RW_CUR_POS)) {
+		uring_destroy(ring);
+		return NULL;
+	}
+
+	// Both rings share one mapping; the entries have their own
+	size_t sq_len = params.sq_off.array
+	    + params.sq_entries * sizeof(unsigned int);
+	size_t cq_len = params.cq_off.cqes
+	    + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->ring_map_len = (sq_len > cq_len ? sq_len : cq_len);
+	ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	void *map = mmap(NULL, ring->ring_map_len, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->ring_map = (map != MAP_FAILED ? map : NULL);
+	map = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	ring->sqes = (map != MAP_FAILED ? map : NULL);
+	ring->buffers = alloc_aligned(PIPELINE_SLOTS * (PIPELINE_BLOCK_SIZE
+							+ OUTPUT_BUFFER_SIZE));
+	if (ring->ring_map == NULL || ring->sqes == NULL
+	    || ring->buffers == NULL) {
+		uring_destroy(ring);
+		return NULL;
+	}
+
+	char *base = ring->ring_map;
+	ring->sq_head = (_Atomic unsigned int *)(base + params.sq_off.head);
+	ring->sq_tail = (_Atomic unsigned int *)(base + params.sq_off.tail);
+	ring->sq_array = (unsigned int *)(base + params.sq_off.array);
+	ring->sq_mask = *(unsigned int *)(base + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->sq_local_tail = atomic_load(ring->sq_tail);
+	ring->cq_head = (_Atomic unsigned int *)(base + params.cq_off.head);
+	ring->cq_tail = (_Atomic unsigned int *)(base + params.cq_off.tail);
+	ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+	ring->cq_mask = *(unsigned int *)(base + params.cq_off.ring_mask);
+
+	// Fixed buffers save the kernel mapping them on every request; without
+	// the memlock allowance, plain reads and writes do
+	struct iovec iovecs[2 * PIPELINE_SLOTS];
+	for (size_t idx = 0; idx < PIPELINE_SLOTS; ++idx) {
+		iovecs[idx].iov_base = ring->buffers + idx * PIPELINE_BLOCK_SIZE;
+		iovecs[idx].iov_len = PIPELINE_BLOCK_SIZE;
+		iovecs[PIPELINE_SLOTS + idx].iov_base = ring->buffers
+		    + PIPELINE_SLOTS * PIPELINE_BLOCK_SIZE
+		    + idx * OUTPUT_BUFFER_SIZE;
+		iovecs[PIPELINE_SLOTS + idx].iov_len = OUTPUT_BUFFER_SIZE;
+	}
+	ring->fixed = (syscall(__NR_io_uring_register, ring->fd,
+			       IORING_REGISTER_BUFFERS, iovecs,
+			       2 * PIPELINE_SLOTS) == 0);
+	return ring;
+}
+
+/*
+* Queue a read or write of <len> bytes at <buf>, from registered buffer
+* <buf_index>, at <offset> (-1 for the file position)
+*/
+static void uring_prepare(struct uring *ring, bool write, int fd, char *buf,
+			  size_t len, long long offset, unsigned int buf_index,
+			  unsigned long long user_data)
+{
+	unsigned int idx = ring->sq_local_tail & ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	if (ring->fixed) {
+		sqe->opcode = (write ? IORING_OP_WRITE_FIXED
+			       : IORING_OP_READ_FIXED);
+		sqe->buf_index = buf_index;
+	} else {
+		sqe->opcode = (write ? IORING_OP_WRITE : IORING_OP_READ);
+	}
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = (unsigned long long)offset;
+	sqe->user_data = user_data;
+
+	ring->sq_array[idx] = idx;
+	++ring->sq_local_tail;
+	++ring->unsubmitted;
+}
+
+/*
+* Submit the queued requests and wait for at least <wait> completions
+*/
+static bool uring_enter(struct uring *ring, unsigned int wait)
+{
+	atomic_store_explicit(ring->sq_tail, ring->sq_local_tail,
+			      memory_order_release);
+	while (true) {
+		long submitted = syscall(__NR_io_uring_enter, ring->fd,
+					 ring->unsubmitted, wait,
+					 wait > 0 ? IORING_ENTER_GETEVENTS : 0,
+					 NULL, 0);
+		if (submitted >= 0) {
+			ring->unsubmitted -= submitted;
+			return true;
+		}
+		if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			return false;
+		}
+	}
+}
+
+/*
+* Take the oldest completion; false if there is none
+*/
+static inline bool uring_reap(struct uring *ring, struct io_uring_cqe *cqe)
+{
+	unsigned int head = atomic_load_explicit(ring->cq_head,
+						 memory_order_relaxed);
+	if (head == atomic_load_explicit(ring->cq_tail, memory_order_acquire)) {
+		return false;
+	}
+	*cqe = ring->cqes[head & ring->cq_mask];
+	atomic_store_explicit(ring->cq_head, head + 1, memory_order_release);
+	return true;
+}
+
+/*
+* A buffer of the ring: <len> of <want> bytes read or written so far
+*/
+struct uring_buffer {
+	char *data;
+	size_t len;
+	size_t want;
+	long long offset;	// -1 for the file position
+	bool busy;		// a request is in flight
+};
+
+/*
+* Buffers are used in sequence; sequence number seq lives in buffer
+* seq % PIPELINE_SLOTS
+*/
+struct uring_job {
+	struct uring *ring;
+	int in_fd;
+	int out_fd;
+	unsigned int max_reads;
+	unsigned int max_writes;
+
+	struct uring_buffer input[PIPELINE_SLOTS];
+	long long in_offset;	// of the next read, or -1
+	unsigned long long in_left;	// bytes not requested yet
+	bool in_eof;
+	unsigned long long in_read;	// bytes encoded
+	size_t reads_issued;
+	size_t reads_used;
+	unsigned int reads_in_flight;
+
+	struct uring_buffer output[PIPELINE_SLOTS];
+	long long out_offset;	// of the next write, or -1
+	size_t fill_len;	// bytes in buffer <writes_filled>
+	size_t writes_filled;
+	size_t writes_issued;
+	size_t writes_done;
+	unsigned int writes_in_flight;
+
+	int read_error;
+	int write_error;
+	int ring_error;
+};
+
+static inline void uring_issue(struct uring_job *job, bool write, size_t seq)
+{
+	struct uring_buffer *buf = (write ? &job->output[seq % PIPELINE_SLOTS]
+				    : &job->input[seq % PIPELINE_SLOTS]);
+	long long offset = (buf->offset < 0 ? -1
+			    : buf->offset + (long long)buf->len);
+
+	buf->busy = true;
+	uring_prepare(job->ring, write, write ? job->out_fd : job->in_fd,
+		      buf->data + buf->len, buf->want - buf->len, offset,
+		      (write ? PIPELINE_SLOTS : 0) + seq % PIPELINE_SLOTS,
+		      (unsigned long long)seq << 1 | write);
+}
+
+/*
+* Start reads into the free input buffers
+*/
+static void uring_issue_reads(struct uring_job *job)
+{
+	while (!job->in_eof && job->in_left > 0
+	       && job->reads_issued < job->reads_used + PIPELINE_SLOTS
+	       && job->reads_in_flight < job->max_reads) {
+		struct uring_buffer *buf =
+		    &job->input[job->reads_issued % PIPELINE_SLOTS];
+		buf->len = 0;
+		buf->want = (job->in_left < PIPELINE_BLOCK_SIZE
+			     ? job->in_left : PIPELINE_BLOCK_SIZE);
+		buf->offset = job->in_offset;
+		if (job->in_offset >= 0) {
+			job->in_offset += buf->want;
+		}
+		job->in_left -= buf->want;
+
+		uring_issue(job, false, job->reads_issued++);
+		++job->reads_in_flight;
+	}
+}
+
+/*
+* Start writes of the filled output buffers, in order
+*/
+static void uring_issue_writes(struct uring_job *job)
+{
+	while (job->writes_issued < job->writes_filled
+	       && job->writes_in_flight < job->max_writes) {
+		struct uring_buffer *buf =
+		    &job->output[job->writes_issued % PIPELINE_SLOTS];
+		buf->len = 0;
+		buf->offset = job->out_offset;
+		if (job->out_offset >= 0) {
+			job->out_offset += buf->want;
+		}
+
+		uring_issue(job, true, job->writes_issued++);
+		++job->writes_in_flight;
+	}
+}
+
+static void uring_complete(struct uring_job *job,
+			   const struct io_uring_cqe *cqe)
+{
+	const bool write = cqe->user_data & 1;
+	const size_t seq = cqe->user_data >> 1;
+	struct uring_buffer *buf = (write ? &job->output[seq % PIPELINE_SLOTS]
+				    : &job->input[seq % PIPELINE_SLOTS]);
+	buf->busy = false;
+
+	if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+		uring_issue(job, write, seq);
+		return;
+	}
+	if (cqe->res < 0 && write) {
+		job->write_error = -cqe->res;
+		--job->writes_in_flight;
+		return;
+	}
+	if (cqe->res < 0) {
+		job->read_error = -cqe->res;
+		--job->reads_in_flight;
+		return;
+	}
+
+	buf->len += cqe->res;
+	if (write) {
+		if (buf->len < buf->want) {
+			uring_issue(job, true, seq);	// short write
+			return;
+		}
+		--job->writes_in_flight;
+		while (job->writes_done < job->writes_issued
+		       && !job->output[job->writes_done % PIPELINE_SLOTS].busy) {
+			++job->writes_done;
+		}
+		return;
+	}
+
+	if (cqe->res == 0) {
+		job->in_eof = true;
+	} else if (buf->len < buf->want && buf->offset >= 0) {
+		uring_issue(job, false, seq);	// short read of a file
+		return;
+	} else if (buf->len < buf->want) {
+		job->in_left += buf->want - buf->len;	// pipes read short
+	}
+	--job->reads_in_flight;
+}
+
+static inline bool uring_failed(const struct uring_job *job)
+{
+	return job->read_error != 0 || job->write_error != 0
+	    || job->ring_error != 0;
+}
+
+/*
+* Submit the queued requests, wait for one to complete, handle every
+* completion and start the requests the freed buffers allow; false if a
+* request or the ring failed
+*/
+static bool uring_wait(struct uring_job *job)
+{
+	if (!uring_enter(job->ring, 1)) {
+		job->ring_error = errno;
+		return false;
+	}
+
+	struct io_uring_cqe cqe;
+	while (uring_reap(job->ring, &cqe)) {
+		uring_complete(job, &cqe);
+	}
+	if (uring_failed(job)) {
+		return false;
+	}
+	uring_issue_reads(job);
+	uring_issue_writes(job);
+	return true;
+}
+
+/*
+* Run the encoder over <src_len> bytes of <src> into the output buffers,
+* issuing each once it is full
+*/
+static bool uring_encode(struct uring_job *job, struct mif_encoder *enc,
+			 const void *src, size_t src_len)
+{
+	while (true) {
+		while (job->writes_filled >= job->writes_done + PIPELINE_SLOTS) {
+			if (!uring_wait(job)) {
+				return false;
+			}
+		}
+
+		struct uring_buffer *buf =
+		    &job->output[job->writes_filled % PIPELINE_SLOTS];
+		job->fill_len += mif_encoder_encode(enc, &src, &src_len,
+						    buf->data + job->fill_len,
+						    OUTPUT_BUFFER_SIZE
+						    - job->fill_len);
+		if (job->fill_len < OUTPUT_BUFFER_SIZE) {
+			return true;	// the encoder wants more input
+		}
+
+		buf->want = job->fill_len;
+		++job->writes_filled;
+		job->fill_len = 0;
+		uring_issue_writes(job);
+	}
+}
+
+/*
+* Encode the input (mapped, or read through the ring up to <in_len> bytes)
+* and write the records to <out_fd> through <ring>. Return the number of
+* words encoded, or -1.
+*/
+long long generate_mif_uring(struct uring *ring, struct input *in, int out_fd,
+			     struct mif_encoder *enc, unsigned long long in_len)
+{
+	struct uring_job job;
+	memset(&job, 0, sizeof(job));
+	job.ring = ring;
+	job.in_fd = in->fd;
+	job.out_fd = out_fd;
+	job.in_left = (in->map == NULL ? in_len : 0);
+	for (size_t idx = 0; idx < PIPELINE_SLOTS; ++idx) {
+		job.input[idx].data = ring->buffers + idx * PIPELINE_BLOCK_SIZE;
+		job.output[idx].data = ring->buffers
+		    + PIPELINE_SLOTS * PIPELINE_BLOCK_SIZE
+		    + idx * OUTPUT_BUFFER_SIZE;
+	}
+
+	// Explicit offsets, and so several requests at once, on regular files
+	job.in_offset = (file_size(in->fd) >= 0
+			 ? lseek(in->fd, 0, SEEK_CUR) : -1);
+	job.out_offset = (positional_output(out_fd)
+			  ? lseek(out_fd, 0, SEEK_CUR) : -1);
+	job.max_reads = (job.in_offset >= 0 ? PIPELINE_SLOTS : 1);
+	job.max_writes = (job.out_offset >= 0 ? PIPELINE_SLOTS : 1);
+
+	bool ok = true;
+	if (in->map != NULL) {
+		ok = uring_encode(&job, enc, in->map, in->map_len);
+		job.in_read = in->map_len;
+	}
+	while (ok && in->map == NULL) {
+		uring_issue_reads(&job);
+		if (job.reads_used == job.reads_issued) {
+			break;	// all read and encoded
+		}
+
+		struct uring_buffer *buf =
+		    &job.input[job.reads_used % PIPELINE_SLOTS];
+		if (buf->busy) {
+			ok = uring_wait(&job);
+			continue;
+		}
+		ok = uring_encode(&job, enc, buf->data, buf->len);
+		job.in_read += buf->len;
+		++job.reads_used;
+	}
+
+	// Hand over the last partial buffer, then let every request finish
+	if (ok && job.fill_len > 0) {
+		while (ok && job.writes_filled
+		       >= job.writes_done + PIPELINE_SLOTS) {
+			ok = uring_wait(&job);
+		}
+		job.output[job.writes_filled % PIPELINE_SLOTS].want = job.fill_len;
+		++job.writes_filled;
+		uring_issue_writes(&job);
+	}
+	if (ok) {
+		uring_issue_writes(&job);
+	}
+	while (job.reads_in_flight + job.writes_in_flight > 0
+	       && job.ring_error == 0) {
+		(void)uring_wait(&job);
+	}
+
+	if (job.read_error != 0) {
+		errno = job.read_error;
+		warn("reading binary words from file");
+		return -1;
+	}
+	if (job.write_error != 0) {
+		errno = job.write_error;
+		warn("writing record to output");
+		return -1;
+	}
+	if (job.ring_error != 0) {
+		errno = job.ring_error;
+		warn("waiting for I/O");
+		return -1;
+	}
+	if (job.out_offset >= 0 && lseek(out_fd, job.out_offset, SEEK_SET) < 0) {
+		warn("seeking past the records");
+		return -1;
+	}
+	if (job.in_read < in_len) {
+		warnx("unexpected EOF");
+	}
+	return mif_encoder_words(enc);
+}
+
+#else				// !HAVE_IO_URING
+
+struct uring *uring_create(void)
+{
+	return NULL;
+}
+
+void uring_destroy(struct uring *ring)
+{
+	(void)ring;
+}
+
+long long generate_mif_uring(struct uring *ring, struct input *in, int out_fd,
+			     struct mif_encoder *enc, unsigned long long in_len)
+{
+	(void)ring;
+	(void)in;
+	(void)out_fd;
+	(void)enc;
+	(void)in_len;
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif				// HAVE_IO_URING
+
+//////////////////////////////////// Arena ////////////////////////////////////
+
+/*
+* The buffers a thread converts with, kept from one file to the next: the
+* output buffer, the input read buffer, grown to the largest size asked for,
+* and with -U the io_uring and its registered buffers
+*/
+struct arena {
+	struct output_buffer *out;
+	byte *input;
+	size_t input_cap;
+	struct uring *ring;	// NULL for POSIX I/O
+};
+
+/*
+* Set up an arena, with an io_uring if <uring> and the kernel has one
+*/
+bool arena_init(struct arena *arena, bool uring)
+{
+	arena->input = NULL;
+	arena->input_cap = 0;
+	arena->ring = (uring ? uring_create() : NULL);
+	arena->out = output_buffer_create(-1);
+	return arena->out != NULL;
+}
+
+/*
+* Return an aligned input buffer of at least <len> bytes, or NULL
+*/
+byte *arena_input(struct arena *arena, size_t len)
+{
+	if (arena->input_cap < len) {
+		free(arena->input);
+		arena->input = alloc_aligned(len);
+		arena->input_cap = (arena->input != NULL ? len : 0);
+	}
+	return arena->input;
+}
+
+void arena_destroy(struct arena *arena)
+{
+	output_buffer_destroy(arena->out);
+	free(arena->input);
+	uring_destroy(arena->ring);
+	arena->out = NULL;
+	arena->ring = NULL;
+	arena->input = NULL;
+	arena->input_cap = 0;
+}
+
+/////////////////////////////////// Events ////////////////////////////////////
+
+/*
+* Threads hand work over through atomic counters. A thread waiting for a
+* counter polls it SPIN_LIMIT times, then sleeps on an event until another
+* thread signals it after changing a counter:
+*
+*	key = event_prepare(ev);
+*	if (ready) event_cancel(ev); else event_sleep(ev, key);
+*
+* Signalling costs an increment and a load while nobody sleeps.
+*/
+struct event {
+	_Atomic unsigned int epoch;	// bumped by every signal
+	_Atomic unsigned int sleepers;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+void event_init(struct event *ev)
+{
+	atomic_init(&ev->epoch, 0);
+	atomic_init(&ev->sleepers, 0);
+	(void)pthread_mutex_init(&ev->lock, NULL);
+	(void)pthread_cond_init(&ev->cond, NULL);
+}
+
+void event_destroy(struct event *ev)
+{
+	(void)pthread_cond_destroy(&ev->cond);
+	(void)pthread_mutex_destroy(&ev->lock);
+}
+
+/*
+* Announce a sleep and return the key to sleep on; check the condition again
+* before sleeping, so a signal sent in between is not lost
+*/
+static inline unsigned int event_prepare(struct event *ev)
+{
+	// Sequentially consistent, like the pair in event_signal: either
+	// the signaller sees this sleeper or the key includes its signal
+	atomic_fetch_add(&ev->sleepers, 1);
+	return atomic_load(&ev->epoch);
+}
+
+static inline void event_cancel(struct event *ev)
+{
+	atomic_fetch_sub(&ev->sleepers, 1);
+}
+
+/*
+* Sleep until a signal after event_prepare returned <key>
+*/
+void event_sleep(struct event *ev, unsigned int key)
+{
+	(void)pthread_mutex_lock(&ev->lock);
+	while (atomic_load_explicit(&ev->epoch, memory_order_acquire) == key) {
+		(void)pthread_cond_wait(&ev->cond, &ev->lock);
+	}
+	(void)pthread_mutex_unlock(&ev->lock);
+	atomic_fetch_sub(&ev->sleepers, 1);
+}
+
+/*
+* Wake every thread sleeping on <ev>
+*/
+static inline void event_signal(struct event *ev)
+{
+	atomic_fetch_add(&ev->epoch, 1);
+	if (atomic_load(&ev->sleepers) > 0) {
+		(void)pthread_mutex_lock(&ev->lock);
+		(void)pthread_cond_broadcast(&ev->cond);
+		(void)pthread_mutex_unlock(&ev->lock);
+	}
+}
+
+////////////////////////////////// Parallel ///////////////////////////////////
+
+/*
+* The address space is cut into chunks that worker threads claim in order.
+*
+* For streams, the chunks are formatted into a ring of slots and the calling
+* thread drains the slots in chunk order, so the output is identical to the
+* serial one. Each slot is handed back and forth through two sequence numbers:
+* <free_for> tells a worker which chunk may be formatted into it and <ready>
+* tells the writer which chunk it holds.
+*
+* For regular output files, every record lands at a closed-form offset, so each
+* worker formats its chunks straight into the memory-mapped file (or writes
+* them in place with pwrite) and nothing is reassembled.
+*/
+struct chunk_slot {
+	_Atomic long long free_for;
+	_Atomic long long ready;
+	long long nwords;
+	size_t len;
+	char *data;
+};
+
+struct parallel_job {
+	const struct mif_encoder *enc;
+	unsigned int width;
+	const byte *words;	// bit-packed unless width is a multiple of 8
+	long long nwords;
+	long long chunk_words;
+	long long nchunks;
+
+	_Atomic long long next_chunk;
+	atomic_bool abort;
+	struct event progress;	// signalled on every slot hand-over and abort
+
+	struct chunk_slot *slots;
+	size_t nslots;
+
+	int out_fd;		// positional output only
+	off_t base_offset;
+	char *out_map;		// NULL when writing with pwrite
+	_Atomic int error;
+};
+
+/*
+* Wait until <*seq> reaches <value> or the job is aborted
+*/
+static inline bool wait_for_seq(struct parallel_job *job, _Atomic long long *seq,
+				long long value)
+{
+	for (unsigned int spins = 0;; ++spins) {
+		if (atomic_load_explicit(seq, memory_order_acquire) == value) {
+			return true;
+		}
+		if (atomic_load_explicit(&job->abort, memory_order_relaxed)) {
+			return false;
+		}
+		if (spins < SPIN_LIMIT) {
+			sched_yield();
+			continue;
+		}
+
+		unsigned int key = event_prepare(&job->progress);
+		if (atomic_load_explicit(seq, memory_order_acquire) == value
+		    || atomic_load_explicit(&job->abort, memory_order_relaxed)) {
+			event_cancel(&job->progress);
+		} else {
+			event_sleep(&job->progress, key);
+		}
+	}
+}
+
+/*
+* Publish <value> to the sequence number <*seq> of a slot
+*/
+static inline void post_seq(struct parallel_job *job, _Atomic long long *seq,
+			    long long value)
+{
+	atomic_store_explicit(seq, value, memory_order_release);
+	event_signal(&job->progress);
+}
+
+/*
+* Stop the job with <error>, waking every waiting thread
+*/
+static inline void abort_job(struct parallel_job *job, int error)
+{
+	if (error != 0) {
+		atomic_store(&job->error, error);
+	}
+	atomic_store(&job->abort, true);
+	event_signal(&job->progress);
+}
+
+/*
+* Return the number of words in <chunk> and store its first address in <first>
+*/
+static inline long long chunk_bounds(const struct parallel_job *job,
+				     long long chunk, long long *first)
+{
+	*first = chunk * job->chunk_words;
+	long long count = job->nwords - *first;
+	if (count > job->chunk_words) {
+		count = job->chunk_words;
+	}
+	return count;
+}
+
+/*
+* Format <chunk> into its slot, which must be free for it, and mark it ready
+*/
+static bool format_chunk(struct parallel_job *job, long long chunk)
+{
+	struct chunk_slot *slot = &job->slots[chunk % job->nslots];
+	long long first = 0;
+	long long count = chunk_bounds(job, chunk, &first);
+	if (!mif_encoder_format(job->enc, slot->data,
+				job->words + first * job->width / 8,
+				count, first)) {
+		abort_job(job, errno);
+		return false;
+	}
+	slot->nwords = count;
+	slot->len = mif_encoder_records_len(job->enc, count);
+	post_seq(job, &slot->ready, chunk);
+	return true;
+}
+
+void *parallel_worker(void *arg)
+{
+	struct parallel_job *job = arg;
+
+	while (true) {
+		long long chunk = atomic_fetch_add(&job->next_chunk, 1);
+		if (chunk >= job->nchunks) {
+			break;
+		}
+
+		struct chunk_slot *slot = &job->slots[chunk % job->nslots];
+		if (!wait_for_seq(job, &slot->free_for, chunk)
+		    || !format_chunk(job, chunk)) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+void *positional_worker(void *arg)
+{
+	struct parallel_job *job = arg;
+
+	char *buffer = NULL;
+	if (job->out_map == NULL
+	    && (buffer = malloc(mif_encoder_records_len(job->enc,
+							job->chunk_words)))
+	    == NULL) {
+		abort_job(job, errno);
+		return NULL;
+	}
+
+	while (!atomic_load_explicit(&job->abort, memory_order_relaxed)) {
+		long long chunk = atomic_fetch_add(&job->next_chunk, 1);
+		if (chunk >= job->nchunks) {
+			break;
+		}
+
+		long long first = 0;
+		long long count = chunk_bounds(job, chunk, &first);
+		const byte *words = job->words + first * job->width / 8;
+		off_t offset = job->base_offset
+		    + mif_encoder_records_len(job->enc, first);
+
+		if (job->out_map != NULL) {
+			if (!mif_encoder_format(job->enc, job->out_map + offset,
+						words, count, first)) {
+				abort_job(job, errno);
+			}
+			continue;
+		}
+
+		if (!mif_encoder_format(job->enc, buffer, words, count, first)
+		    || !pwrite_all(job->out_fd, buffer,
+				   mif_encoder_records_len(job->enc, count),
+				   offset)) {
+			abort_job(job, errno);
+		}
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+/*
+* Start up to <jobs> threads running <worker>; return how many were started
+*/
+unsigned int start_workers(pthread_t *threads, unsigned int jobs,
+			   void *(*worker)(void *), struct parallel_job *job)
+{
+	unsigned int nthreads = 0;
+	for (; nthreads < jobs; ++nthreads) {
+		errno = pthread_create(&threads[nthreads], NULL, worker, job);
+		if (errno != 0) {
+			warn("starting worker thread");
+			break;
+		}
+	}
+	return nthreads;
+}
+
+void join_workers(pthread_t *threads, unsigned int nthreads)
+{
+	for (unsigned int idx = 0; idx < nthreads; ++idx) {
+		(void)pthread_join(threads[idx], NULL);
+	}
+}
+
+static inline void parallel_job_init(struct parallel_job *job,
+				     const struct mif_encoder *enc,
+				     const struct mif_config *config,
+				     const byte *words, long long nwords)
+{
+	// Chunks are whole records, and bit-packed ones multiples of 8 words
+	// too, so they start on a byte
+	long long unit_words = config->words_per_line;
+	while (config->width % 8 != 0 && unit_words % 8 != 0) {
+		unit_words += config->words_per_line;
+	}
+
+	job->enc = enc;
+	job->width = config->width;
+	job->words = words;
+	job->nwords = nwords;
+	job->chunk_words = (CHUNK_SIZE / mif_encoder_records_len(enc, unit_words)
+			    + 1) * unit_words;
+	job->nchunks = (nwords + job->chunk_words - 1) / job->chunk_words;
+	job->slots = NULL;
+	job->nslots = 0;
+	job->out_fd = -1;
+	job->base_offset = 0;
+	job->out_map = NULL;
+	atomic_init(&job->next_chunk, 0);
+	atomic_init(&job->abort, false);
+	atomic_init(&job->error, 0);
+	event_init(&job->progress);
+}
+
+/*
+* Format the first <nwords> words of <words> on <jobs> threads straight into
+* the regular file <out_fd>, starting at its current offset. The file is
+* preallocated to its final size, END; trailer included, and memory-mapped;
+* if the blocks cannot be reserved or the file cannot be mapped, chunks are
+* written in place with pwrite instead, so a full disk is reported as a write
+* error rather than as SIGBUS or lost write-back. The offset is left after the
+* last record. Return the number of words written.
+*/
+long long generate_mif_positional(int out_fd, const byte *words,
+				  long long nwords,
+				  const struct mif_encoder *enc,
+				  const struct mif_config *config,
+				  unsigned int jobs)
+{
+	struct parallel_job job;
+	parallel_job_init(&job, enc, config, words, nwords);
+	job.out_fd = out_fd;
+	job.base_offset = lseek(out_fd, 0, SEEK_CUR);
+	if (job.base_offset < 0) {
+		warn("getting output file offset");
+		event_destroy(&job.progress);
+		return -1;
+	}
+
+	const off_t content_end = job.base_offset
+	    + mif_encoder_records_len(enc, nwords);
+	const off_t file_len = content_end + strlen(MIF_TRAILER);
+
+	// Reserve the blocks up front, so running out of space fails here
+	// rather than as SIGBUS on the mapping; map only what is reserved
+	errno = posix_fallocate(out_fd, job.base_offset,
+				file_len - job.base_offset);
+	if (errno != 0 && errno != EOPNOTSUPP && errno != EINVAL) {
+		warn("allocating output file");
+		event_destroy(&job.progress);
+		return -1;
+	}
+	bool reserved = (errno == 0);
+
+	if (ftruncate(out_fd, file_len) == 0 && reserved) {
+		void *map = mmap(NULL, content_end, PROT_READ | PROT_WRITE,
+				 MAP_SHARED, out_fd, 0);
+		job.out_map = (map != MAP_FAILED ? map : NULL);
+	}
+
+	if (jobs == 1 || job.nchunks <= 1) {
+		(void)positional_worker(&job);
+	} else {
+		pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+		if (threads == NULL) {
+			warn("allocating worker state");
+			goto unmap;
+		}
+
+		unsigned int nthreads = start_workers(threads, jobs,
+						      positional_worker, &job);
+		join_workers(threads, nthreads);
+		free(threads);
+
+		if (nthreads == 0) {	// format serially instead
+			(void)positional_worker(&job);
+		}
+	}
+
+	if (atomic_load(&job.error) != 0) {
+		errno = atomic_load(&job.error);
+		warn("writing record to output");
+		goto unmap;
+	}
+	if (lseek(out_fd, content_end, SEEK_SET) < 0) {
+		warn("seeking past the records");
+		goto unmap;
+	}
+	// Write-back errors of the mapping are only reported by msync
+	if (job.out_map != NULL) {
+		bool synced = (msync(job.out_map, content_end, MS_SYNC) == 0);
+		bool unmapped = (munmap(job.out_map, content_end) == 0);
+		if (!synced || !unmapped) {
+			warn("writing record to output");
+			event_destroy(&job.progress);
+			return -1;
+		}
+	}
+	event_destroy(&job.progress);
+	return nwords;
+
+ unmap:
+	if (job.out_map != NULL) {
+		(void)munmap(job.out_map, content_end);
+	}
+	event_destroy(&job.progress);
+	return -1;
+}
+
+/*
+* Format the first <nwords> words of <words> on <jobs> threads and write them
+* to <out_fd> in order. Return the number of words written.
+*/
+long long generate_mif_parallel(int out_fd, const byte *words, long long nwords,
+				const struct mif_encoder *enc,
+				const struct mif_config *config,
+				unsigned int jobs)
+{
+	struct parallel_job job;
+	parallel_job_init(&job, enc, config, words, nwords);
+	job.nslots = 2 * jobs;
+
+	job.slots = calloc(job.nslots, sizeof(struct chunk_slot));
+	pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+	if (job.slots == NULL || threads == NULL) {
+		warn("allocating worker state");
+		free(job.slots);
+		free(threads);
+		event_destroy(&job.progress);
+		return -1;
+	}
+
+	long long words_written = -1;
+	const size_t slot_len = mif_encoder_records_len(enc, job.chunk_words);
+	const size_t pipe_capacity = pipe_grow(out_fd);
+	size_t nslots = 0;
+	for (; nslots < job.nslots; ++nslots) {
+		struct chunk_slot *slot = &job.slots[nslots];
+		slot->data = alloc_pages(slot_len);
+		if (slot->data == NULL) {
+			warn("allocating chunk buffers");
+			goto free_slots;
+		}
+		atomic_init(&slot->free_for, nslots);
+		atomic_init(&slot->ready, -1);
+	}
+
+	unsigned int nthreads = start_workers(threads, jobs, parallel_worker,
+					      &job);
+
+	// Drain the slots in order; if no worker could be started, format each
+	// chunk here first. Chunks from <held> on are written but their slots
+	// not yet free: a chunk spliced into a pipe is held until the next
+	// splice, so with at least two slots the next chunk's is always free.
+	words_written = 0;
+	long long held = 0;
+	for (long long chunk = 0; chunk < job.nchunks; ++chunk) {
+		struct chunk_slot *slot = &job.slots[chunk % job.nslots];
+		if ((nthreads == 0 && !format_chunk(&job, chunk))
+		    || !wait_for_seq(&job, &slot->ready, chunk)) {
+			errno = atomic_load(&job.error);
+			warn("formatting records");
+			break;
+		}
+
+		bool spliced = false;
+		if (!pipe_write(out_fd, pipe_capacity, slot->data, slot->len,
+				&spliced)) {
+			warn("writing record to output");
+			break;
+		}
+		words_written += slot->nwords;
+
+		long long release_end = (spliced ? chunk
+					 : held == chunk ? chunk + 1 : held);
+		for (; held < release_end; ++held) {
+			post_seq(&job, &job.slots[held % job.nslots].free_for,
+				 held + job.nslots);
+		}
+		if (spliced) {
+			held = chunk;
+		}
+	}
+	abort_job(&job, 0);
+	join_workers(threads, nthreads);
+
+ free_slots:
+	for (size_t idx = 0; idx < nslots; ++idx) {
+		free_pages(job.slots[idx].data, slot_len);
+	}
+	free(job.slots);
+	free(threads);
+	event_destroy(&job.progress);
+	return words_written;
+}
+
+/*
+* CPUs the quota of the cgroup directory <dir> allows, or 0 if it has none
+*/
+static unsigned int cgroup_quota(const char *dir, bool v2)
+{
+	char path[PATH_MAX];
+	long long quota = -1;
+	long long period = -1;
+
+	int len = snprintf(path, sizeof(path), "%s/%s", dir,
+			   v2 ? "cpu.max" : "cpu.cfs_quota_us");
+	FILE *file = ((size_t)len < sizeof(path) ? fopen(path, "r") : NULL);
+	if (file == NULL) {
+		return 0;
+	}
+	if (v2 ? fscanf(file, "%lld %lld", &quota, &period) != 2
+	    : fscanf(file, "%lld", &quota) != 1) {
+		quota = -1;	// "max": no quota
+	}
+	fclose(file);
+
+	if (!v2) {
+		len = snprintf(path, sizeof(path), "%s/cpu.cfs_period_us", dir);
+		if ((size_t)len < sizeof(path)
+		    && (file = fopen(path, "r")) != NULL) {
+			if (fscanf(file, "%lld", &period) != 1) {
+				period = -1;
+			}
+			fclose(file);
+		}
+	}
+
+	return (quota > 0 && period > 0
+		? (unsigned int)((quota + period - 1) / period) : 0);
+}
+
+/*
+* Lowest CPU quota of the cgroup <path> of the hierarchy mounted at <mount>
+* and of its ancestors, or 0 if none has one. <path> is cut down as the
+* ancestors are visited; levels not visible in this mount namespace are
+* skipped.
+*/
+static unsigned int cgroup_tree_limit(const char *mount, char *path, bool v2)
+{
+	unsigned int limit = 0;
+	char dir[PATH_MAX];
+
+	while (true) {
+		int len = snprintf(dir, sizeof(dir), "%s%s", mount, path);
+		unsigned int quota = ((size_t)len < sizeof(dir)
+				      ? cgroup_quota(dir, v2) : 0);
+		if (quota > 0 && (limit == 0 || quota < limit)) {
+			limit = quota;
+		}
+
+		char *slash = strrchr(path, '/');
+		if (slash == NULL || strcmp(path, "/") == 0) {
+			return limit;
+		}
+		slash[slash == path ? 1 : 0] = '\0';
+	}
+}
+
+/*
+* CPUs the cgroup quotas of this process allow, or 0 if there are none. The
+* cgroups come from /proc/self/cgroup: "0::<path>" for cgroup v2, or
+* "<id>:<controllers>:<path>" for a v1 hierarchy with the cpu controller.
+*/
+static unsigned int cgroup_cpu_limit(void)
+{
+	FILE *file = fopen("/proc/self/cgroup", "r");
+	if (file == NULL) {
+		return 0;
+	}
+
+	unsigned int limit = 0;
+	char *line = NULL;
+	size_t line_cap = 0;
+	ssize_t len = 0;
+	while ((len = getline(&line, &line_cap, file)) > 0) {
+		if (line[len - 1] == '\n') {
+			line[len - 1] = '\0';
+		}
+		char *controllers = strchr(line, ':');
+		char *path = (controllers != NULL
+			      ? strchr(controllers + 1, ':') : NULL);
+		if (path == NULL || path[1] != '/') {
+			continue;
+		}
+		*controllers++ = '\0';
+		*path++ = '\0';
+
+		unsigned int quota = 0;
+		if (strcmp(line, "0") == 0 && *controllers == '\0') {
+			quota = cgroup_tree_limit("/sys/fs/cgroup", path, true);
+		} else {
+			char *save = NULL;
+			for (char *name = strtok_r(controllers, ",", &save);
+			     name != NULL; name = strtok_r(NULL, ",", &save)) {
+				if (strcmp(name, "cpu") == 0) {
+					quota = cgroup_tree_limit
+					    ("/sys/fs/cgroup/cpu", path, false);
+					break;
+				}
+			}
+		}
+		if (quota > 0 && (limit == 0 || quota < limit)) {
+			limit = quota;
+		}
+	}
+
+	free(line);
+	fclose(file);
+	return limit;
+}
+
+/*
+* Number of CPUs this process may run on, honouring both the affinity mask and
+* the cgroup CPU quotas
+*/
+unsigned int available_cpus(void)
+{
+	unsigned int cpus = 1;
+
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+		cpus = CPU_COUNT(&set);
+	} else {
+		long online = sysconf(_SC_NPROCESSORS_ONLN);
+		cpus = (online > 0 ? online : 1);
+	}
+
+	unsigned int limit = cgroup_cpu_limit();
+	if (limit > 0 && limit < cpus) {
+		cpus = limit;
+	}
+
+	return cpus;
+}
+
+////////////////////////////////// Pipeline ///////////////////////////////////
+
+/*
+* Input that cannot be mapped runs through three stages on -j 2 or more: a
+* reader thread, the encoder on the calling thread and a writer thread. They
+* hand large aligned buffers over through two bounded single-producer,
+* single-consumer rings, so slow reads overlap formatting and writes, and a
+* slow stage holds the others back once its ring is full. The encoder carries
+* words split across buffers, so the reader fills them with plain reads.
+* Output buffers the writer splices into a pipe are released one buffer late.
+*/
+struct ring_slot {
+	char *data;
+	size_t len;
+	bool last;		// no slots follow
+};
+
+struct spsc_ring {
+	struct ring_slot slots[PIPELINE_SLOTS];
+	_Alignas(BUFFER_ALIGNMENT) _Atomic size_t head;	// slots published
+	_Alignas(BUFFER_ALIGNMENT) _Atomic size_t tail;	// slots released
+	struct event changed;	// signalled on every publish and release
+};
+
+struct pipeline {
+	int in_fd;
+	int out_fd;
+	size_t pipe_capacity;	// of <out_fd>, 0 unless a pipe
+	unsigned long long in_len;	// bytes to read at most
+
+	struct spsc_ring input;
+	struct spsc_ring output;
+
+	atomic_bool abort;
+	_Atomic int read_error;
+	_Atomic int write_error;
+	atomic_bool eof;	// the input ended before <in_len> bytes
+};
+
+/*
+* True if <ring> holds at least <min> and fewer than <max> slots published but
+* not yet released
+*/
+static inline bool ring_ready(struct spsc_ring *ring, size_t min, size_t max)
+{
+	size_t used = atomic_load_explicit(&ring->head, memory_order_acquire)
+	    - atomic_load_explicit(&ring->tail, memory_order_acquire);
+	return (used >= min && used < max);
+}
+
+/*
+* Wait until ring_ready(<ring>, <min>, <max>); false if the pipeline is
+* aborted first
+*/
+static bool ring_wait(struct spsc_ring *ring, size_t min, size_t max,
+		      atomic_bool *abort)
+{
+	for (unsigned int spins = 0;; ++spins) {
+		if (ring_ready(ring, min, max)) {
+			return true;
+		}
+		if (atomic_load_explicit(abort, memory_order_relaxed)) {
+			return false;
+		}
+		if (spins < SPIN_LIMIT) {
+			sched_yield();
+			continue;
+		}
+
+		unsigned int key = event_prepare(&ring->changed);
+		if (ring_ready(ring, min, max) || atomic_load(abort)) {
+			event_cancel(&ring->changed);
+		} else {
+			event_sleep(&ring->changed, key);
+		}
+	}
+}
+
+/*
+* Return the next slot to fill once the consumer has released it, or NULL
+* if the pipeline is aborted
+*/
+static inline struct ring_slot *ring_claim(struct spsc_ring *ring,
+					   atomic_bool *abort)
+{
+	if (!ring_ready(ring, 0, PIPELINE_SLOTS)
+	    && !ring_wait(ring, 0, PIPELINE_SLOTS, abort)) {
+		return NULL;
+	}
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	return &ring->slots[head % PIPELINE_SLOTS];
+}
+
+static inline void ring_publish(struct spsc_ring *ring)
+{
+	size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	event_signal(&ring->changed);
+}
+
+/*
+* Return the published slot <ahead> places after the oldest unreleased one,
+* or NULL if the pipeline is aborted
+*/
+static inline struct ring_slot *ring_peek(struct spsc_ring *ring,
+					  size_t ahead, atomic_bool *abort)
+{
+	if (!ring_ready(ring, ahead + 1, SIZE_MAX)
+	    && !ring_wait(ring, ahead + 1, SIZE_MAX, abort)) {
+		return NULL;
+	}
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	return &ring->slots[(tail + ahead) % PIPELINE_SLOTS];
+}
+
+static inline void ring_release(struct spsc_ring *ring)
+{
+	size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+	event_signal(&ring->changed);
+}
+
+static void pipeline_destroy(struct pipeline *pipeline)
+{
+	event_destroy(&pipeline->input.changed);
+	event_destroy(&pipeline->output.changed);
+}
+
+/*
+* Abort the pipeline and wake the stages waiting on either ring
+*/
+static void pipeline_stop(struct pipeline *pipeline)
+{
+	atomic_store(&pipeline->abort, true);
+	event_signal(&pipeline->input.changed);
+	event_signal(&pipeline->output.changed);
+}
+
+void *pipeline_reader(void *arg)
+{
+	struct pipeline *pipeline = arg;
+	unsigned long long left = pipeline->in_len;
+
+	while (true) {
+		struct ring_slot *slot = ring_claim(&pipeline->input,
+						    &pipeline->abort);
+		if (slot == NULL) {
+			return NULL;
+		}
+
+		size_t cap = (left < PIPELINE_BLOCK_SIZE
+			      ? left : PIPELINE_BLOCK_SIZE);
+		bool eof = false;
+		slot->len = 0;
+		while (slot->len < cap) {
+			ssize_t chunk = read(pipeline->in_fd,
+					     slot->data + slot->len,
+					     cap - slot->len);
+			if (chunk < 0 && errno == EINTR) {
+				continue;
+			}
+			if (chunk < 0) {
+				atomic_store(&pipeline->read_error, errno);
+				pipeline_stop(pipeline);
+				return NULL;
+			}
+			if (chunk == 0) {
+				eof = true;
+				break;
+			}
+			slot->len += chunk;
+		}
+
+		left -= slot->len;
+		slot->last = (eof || left == 0);
+		if (eof && left > 0) {
+			atomic_store(&pipeline->eof, true);
+		}
+		ring_publish(&pipeline->input);
+		if (slot->last) {
+			return NULL;
+		}
+	}
+}
+
+void *pipeline_writer(void *arg)
+{
+	struct pipeline *pipeline = arg;
+	size_t held = 0;	// written slots not yet released
+
+	while (true) {
+		struct ring_slot *slot = ring_peek(&pipeline->output, held,
+						   &pipeline->abort);
+		if (slot == NULL) {
+			return NULL;
+		}
+
+		bool spliced = false;
+		if (!pipe_write(pipeline->out_fd, pipeline->pipe_capacity,
+				slot->data, slot->len, &spliced)) {
+			atomic_store(&pipeline->write_error, errno);
+			pipeline_stop(pipeline);
+			return NULL;
+		}
+		bool last = slot->last;
+
+		// A spliced slot is held until the next splice pushes it out of
+		// the pipe; copied slots are released as soon as all before are
+		if (spliced) {
+			for (; held > 0; --held) {
+				ring_release(&pipeline->output);
+			}
+			held = 1;
+		} else if (held == 0) {
+			ring_release(&pipeline->output);
+		} else {
+			++held;
+		}
+		if (last) {
+			return NULL;
+		}
+	}
+}
+
+/*
+* Encode up to <in_len> bytes from <in_fd> with a reader and a writer thread,
+* writing the records to <out_fd>. Return the number of words encoded, or -1.
+*/
+long long generate_mif_pipeline(int in_fd, int out_fd,
+				struct mif_encoder *enc,
+				unsigned long long in_len)
+{
+	struct pipeline pipeline;
+	pipeline.in_fd = in_fd;
+	pipeline.out_fd = out_fd;
+	pipeline.pipe_capacity = pipe_grow(out_fd);
+	pipeline.in_len = in_len;
+	atomic_init(&pipeline.input.head, 0);
+	atomic_init(&pipeline.input.tail, 0);
+	atomic_init(&pipeline.output.head, 0);
+	atomic_init(&pipeline.output.tail, 0);
+	atomic_init(&pipeline.abort, false);
+	atomic_init(&pipeline.read_error, 0);
+	atomic_init(&pipeline.write_error, 0);
+	atomic_init(&pipeline.eof, false);
+	event_init(&pipeline.input.changed);
+	event_init(&pipeline.output.changed);
+
+	const size_t buffers_len = PIPELINE_SLOTS * (PIPELINE_BLOCK_SIZE
+						     + OUTPUT_BUFFER_SIZE);
+	char *buffers = alloc_pages(buffers_len);
+	if (buffers == NULL) {
+		warn("allocating pipeline buffers");
+		pipeline_destroy(&pipeline);
+		return -1;
+	}
+	for (size_t idx = 0; idx < PIPELINE_SLOTS; ++idx) {
+		pipeline.input.slots[idx].data = buffers
+		    + idx * PIPELINE_BLOCK_SIZE;
+		pipeline.output.slots[idx].data = buffers
+		    + PIPELINE_SLOTS * PIPELINE_BLOCK_SIZE
+		    + idx * OUTPUT_BUFFER_SIZE;
+	}
+
+	pthread_t reader;
+	pthread_t writer;
+	errno = pthread_create(&reader, NULL, pipeline_reader, &pipeline);
+	if (errno != 0) {
+		warn("starting reader thread");
+		free_pages(buffers, buffers_len);
+		pipeline_destroy(&pipeline);
+		return -1;
+	}
+	errno = pthread_create(&writer, NULL, pipeline_writer, &pipeline);
+	if (errno != 0) {
+		warn("starting writer thread");
+		pipeline_stop(&pipeline);
+		(void)pthread_join(reader, NULL);
+		free_pages(buffers, buffers_len);
+		pipeline_destroy(&pipeline);
+		return -1;
+	}
+
+	// Every input buffer is encoded into output buffers, each handed to
+	// the writer once full; the last one goes out with whatever it holds
+	struct ring_slot *out = ring_claim(&pipeline.output, &pipeline.abort);
+	if (out != NULL) {
+		out->len = 0;
+	}
+	for (bool last = false; out != NULL && !last;) {
+		struct ring_slot *in = ring_peek(&pipeline.input, 0,
+						 &pipeline.abort);
+		if (in == NULL) {
+			break;
+		}
+
+		const void *src = in->data;
+		size_t src_len = in->len;
+		last = in->last;
+		while (out != NULL) {
+			out->len += mif_encoder_encode(enc, &src, &src_len,
+						       out->data + out->len,
+						       OUTPUT_BUFFER_SIZE
+						       - out->len);
+			if (out->len < OUTPUT_BUFFER_SIZE) {
+				break;	// the encoder wants more input
+			}
+			out->last = false;
+			ring_publish(&pipeline.output);
+			if ((out = ring_claim(&pipeline.output,
+					      &pipeline.abort)) != NULL) {
+				out->len = 0;
+			}
+		}
+		ring_release(&pipeline.input);
+	}
+	if (out != NULL) {
+		out->last = true;
+		ring_publish(&pipeline.output);
+	}
+
+	(void)pthread_join(reader, NULL);
+	(void)pthread_join(writer, NULL);
+	free_pages(buffers, buffers_len);
+	pipeline_destroy(&pipeline);
+
+	if (atomic_load(&pipeline.read_error) != 0) {
+		errno = atomic_load(&pipeline.read_error);
+		warn("reading binary words from file");
+		return -1;
+	}
+	if (atomic_load(&pipeline.write_error) != 0) {
+		errno = atomic_load(&pipeline.write_error);
+		warn("writing record to output");
+		return -1;
+	}
+	if (atomic_load(&pipeline.eof)) {
+		warnx("unexpected EOF");
+	}
+	return mif_encoder_words(enc);
+}
+
+////////////////////////////////// Generator //////////////////////////////////
+
+/*
+* Run the encoder over <len> bytes of <src>, straight into the free space of
+* the output buffer
+*/
+bool encode_to_output(struct output_buffer *out, struct mif_encoder *enc,
+		      const void *src, size_t len)
+{
+	while (true) {
+		out->len += mif_encoder_encode(enc, &src, &len,
+					       out->data + out->len,
+					       OUTPUT_BUFFER_SIZE - out->len);
+		if (out->len < OUTPUT_BUFFER_SIZE) {
+			return true;	// the encoder wants more input
+		}
+		if (!output_buffer_flush(out)) {
+			return false;
+		}
+	}
+}
+
+long long generate_mif_content(struct input *in, struct output_buffer *out,
+			       struct mif_encoder *enc, long long depth,
+			       unsigned int width)
+{
+	const long long unit_words = (width % 8 == 0 ? 1 : 8);
+
+	for (long long addr = 0; addr < depth;) {
+		// Mapped input is handed over in one piece
+		const byte *units = NULL;
+		size_t nunits = SIZE_MAX;
+		unsigned long long units_left = (depth - addr + unit_words - 1)
+		    / unit_words;
+		if (units_left < nunits) {
+			nunits = units_left;
+		}
+
+		ssize_t units_read = input_next(in, nunits, &units);
+		if (units_read < 0) {
+			warn("reading binary words from file");
+			break;
+		}
+		if (units_read == 0) {
+			// A short last group of packed words still holds
+			// whole words
+			const byte *tail = NULL;
+			size_t tail_len = input_tail(in, &tail);
+			if (!encode_to_output(out, enc, tail, tail_len)) {
+				warn("writing record to output");
+				return -1;
+			}
+			if (addr + (long long)(tail_len * 8 / width) < depth) {
+				warnx("unexpected EOF");
+			}
+			break;
+		}
+
+		if (!encode_to_output(out, enc, units,
+				      units_read * in->unit_size)) {
+			warn("writing record to output");
+			return -1;
+		}
+		addr += units_read * unit_words;
+	}
+
+	return mif_encoder_words(enc);
+}
+
+/*
+* Convert <in_fd> to a .mif file on <out_fd> with the buffers of <arena>,
+* formatting on up to <jobs> threads. Return the number of words written, or
+* -1.
+*/
+long long generate_mif(int in_fd, int out_fd,
+		       const struct mif_config *config, unsigned int jobs,
+		       struct arena *arena)
+{
+	long long depth = config->depth;
+	const unsigned int width = config->width;
+	off_t in_file_size = file_size(in_fd);
+
+	// Argument validation
+	if (depth > LLONG_MAX / width) {
+		errno = ERANGE;
+		warn("%lld words of %u bits", depth, width);
+		return -1;
+	}
+	const long long bytes_requested = (depth < 0 ? -1
+					   : (depth * width + 7) / 8);
+	if (in_file_size == -1)	// system error
+	{
+		warn("getting file size");
+		return -1;
+	}
+
+	// A stream of unknown length is read to its end into memory first,
+	// then converted like a file of that size
+	int spool = -1;
+	if (in_file_size == -2 && depth < 0) {
+		if ((spool = spool_input(in_fd)) < 0
+		    || (in_file_size = file_size(spool)) < 0) {
+			warn("spooling input");
+			(void)safe_close(&spool);
+			return -1;
+		}
+		in_fd = spool;
+	}
+
+	if (depth < 0) {
+		depth = in_file_size * 8 / width;
+	}			// desired depth equals the file size
+	else if (in_file_size != -2 && in_file_size < bytes_requested)	// file is too short
+	{
+		warnx
+		    ("%lld bytes were requested, but the input file only contains %ld",
+		     bytes_requested, in_file_size);
+	}
+
+	struct mif_config resolved = *config;
+	resolved.depth = depth;
+	struct mif_encoder *enc = mif_encoder_create(&resolved);
+	if (enc == NULL) {
+		warn("setting up the encoder");
+		(void)safe_close(&spool);
+		return -1;
+	}
+
+	const size_t unit_size = (width % 8 == 0 ? width / 8 : width);
+	byte *buffer = arena_input(arena, input_buffer_len(unit_size));
+	if (buffer == NULL) {
+		warn("allocating input buffer");
+		mif_encoder_destroy(enc);
+		(void)safe_close(&spool);
+		return -1;
+	}
+
+	struct input in;
+	input_init(&in, in_fd, unit_size, buffer);
+	if (in_file_size == -2) {
+		(void)pipe_grow(in_fd);
+	} else {
+		input_map(&in, in_file_size < bytes_requested || bytes_requested < 0
+			  ? in_file_size : bytes_requested);
+	}
+
+	struct output_buffer *out = arena->out;
+	output_buffer_reset(out, out_fd);
+
+	long long word_count = -1;
+	if (!encode_to_output(out, enc, NULL, 0)) {
+		warn("writing .mif header");
+		goto cleanup;
+	}
+
+	// Fill in the content. Fixed-length records from mapped input are
+	// formatted straight into regular output files, and on worker threads
+	// when they span several chunks.
+	const bool fixed = (mif_encoder_record_len(enc) > 0);
+	long long mapped_words = in.map_len * 8 / width;
+	if (mapped_words > depth) {
+		mapped_words = depth;
+	}
+	bool in_place = (fixed && mapped_words > 0
+			 && positional_output(out_fd));
+	bool parallel = (fixed && jobs > 1
+			 && mif_encoder_records_len(enc, mapped_words)
+			 > CHUNK_SIZE);
+
+	if (in_place || parallel) {
+		if (!output_buffer_flush(out)) {
+			warn("writing .mif header");
+			goto cleanup;
+		}
+		word_count = (in_place
+			      ? generate_mif_positional(out_fd, in.map,
+							mapped_words, enc,
+							&resolved, jobs)
+			      : generate_mif_parallel(out_fd, in.map,
+						      mapped_words, enc,
+						      &resolved, jobs));
+		if (word_count < 0) {
+			goto cleanup;
+		}
+		mif_encoder_advance(enc, word_count);
+		if (word_count == mapped_words && word_count < depth) {
+			warnx("unexpected EOF");
+		}
+	} else if (arena->ring != NULL) {
+		if (!output_buffer_flush(out)) {
+			warn("writing .mif header");
+			goto cleanup;
+		}
+		if (generate_mif_uring(arena->ring, &in, out_fd, enc,
+				       (depth * width + 7) / 8) < 0) {
+			goto cleanup;
+		}
+	} else if (jobs > 1 && in.map == NULL) {
+		if (!output_buffer_flush(out)) {
+			warn("writing .mif header");
+			goto cleanup;
+		}
+		if (generate_mif_pipeline(in_fd, out_fd, enc,
+					  (depth * width + 7) / 8) < 0) {
+			goto cleanup;
+		}
+	} else if (generate_mif_content(&in, out, enc, depth, width) < 0) {
+		goto cleanup;
+	}
+
+	// End file
+	mif_encoder_finish(enc);
+	if (!encode_to_output(out, enc, NULL, 0) || !output_buffer_flush(out)) {
+		warn("ending .mif file");
+		goto cleanup;
+	}
+	word_count = mif_encoder_words(enc);
+
+ cleanup:
+	input_destroy(&in);
+	mif_encoder_destroy(enc);
+	(void)safe_close(&spool);
+	return word_count;
+}
+
+/////////////////////////////////// Reverse ///////////////////////////////////
+
+/*
+* mif2bin: parse a .mif file and write the raw image, every word in width / 8
+* bytes of the requested byte order, or bit-packed like bin2mif's input when
+* the width is not a multiple of 8. Addresses missing from the file are left
+* zero.
+*/
+
+/*
+* Pack <nwords> words of ceil(width / 8) bytes into consecutive <width>-bit
+* fields, least significant bit first, the layout bin2mif reads them in
+*/
+void pack_words(byte *dest, const byte *words, size_t nwords,
+		unsigned int width)
+{
+	const size_t word_size = ((size_t)width + 7) / 8;
+	uint64_t bits = 0;
+	unsigned int nbits = 0;
+
+	for (size_t word_idx = 0; word_idx < nwords; ++word_idx) {
+		// 7 bytes at a time, so the accumulator never overflows
+		for (size_t idx = 0; idx < word_size; idx += 7) {
+			size_t field = width - 8 * idx;
+			if (field > 56) {
+				field = 56;
+			}
+
+			uint64_t value = 0;
+			for (size_t shift = 0; shift < 7 && idx + shift < word_size;
+			     ++shift) {
+				value |= (uint64_t)words[idx + shift] << (8 * shift);
+			}
+			bits |= (value & ((1ull << field) - 1)) << nbits;
+			nbits += field;
+
+			for (; nbits >= 8; nbits -= 8) {
+				*dest++ = bits & 0xff;
+				bits >>= 8;
+			}
+		}
+		words += word_size;
+	}
+
+	if (nbits > 0) {
+		*dest = bits & 0xff;
+	}
+}
+
+struct decode_job {
+	const struct mif_loader *loader;
+	unsigned int width;
+	enum mif_byte_order byte_order;
+	byte *image;
+	long long first;
+	long long count;
+	long long decoded;
+};
+
+void *decode_worker(void *arg)
+{
+	struct decode_job *job = arg;
+	if (job->width % 8 == 0) {
+		job->decoded = mif_loader_decode(job->loader, job->image,
+						 job->first, job->count);
+		if (job->decoded > 0) {
+			(void)mif_swap_words(job->image, job->decoded,
+					     job->width, job->byte_order);
+		}
+		return NULL;
+	}
+
+	// Decode a block of whole-byte words at a time and pack it; blocks are
+	// multiples of 8 words, so they start on a byte
+	const size_t word_size = ((size_t)job->width + 7) / 8;
+	long long block_len = DECODE_BLOCK_SIZE / word_size / 8 * 8;
+	if (block_len == 0) {
+		block_len = 8;
+	}
+	byte *words = alloc_aligned(block_len * word_size);
+	job->decoded = 0;
+	if (words == NULL) {
+		return NULL;
+	}
+
+	while (job->decoded < job->count) {
+		long long block = job->count - job->decoded;
+		if (block > block_len) {
+			block = block_len;
+		}
+
+		long long decoded = mif_loader_decode(job->loader, words,
+						      job->first + job->decoded,
+						      block);
+		if (decoded != block) {
+			job->decoded += (decoded > 0 ? decoded : 0);
+			break;
+		}
+		pack_words(job->image + job->decoded * job->width / 8, words,
+			   block, job->width);
+		job->decoded += block;
+	}
+
+	free(words);
+	return NULL;
+}
+
+/*
+* Load the whole input into memory: mapped for regular files, read otherwise.
+* Return NULL on failure.
+*/
+char *load_text(int in_fd, size_t *len, bool *mapped)
+{
+	off_t in_file_size = file_size(in_fd);
+	if (in_file_size > 0) {
+		void *map = mmap(NULL, in_file_size, PROT_READ, MAP_PRIVATE,
+				 in_fd, 0);
+		if (map != MAP_FAILED) {
+			(void)posix_madvise(map, in_file_size,
+					    POSIX_MADV_SEQUENTIAL);
+			*len = in_file_size;
+			*mapped = true;
+			return map;
+		}
+	}
+
+	size_t cap = OUTPUT_BUFFER_SIZE;
+	char *text = malloc(cap);
+	*len = 0;
+	*mapped = false;
+
+	while (text != NULL) {
+		if (*len == cap) {
+			char *grown = realloc(text, 2 * cap);
+			if (grown == NULL) {
+				break;
+			}
+			text = grown;
+			cap *= 2;
+		}
+
+		ssize_t chunk = read(in_fd, text + *len, cap - *len);
+		if (chunk < 0 && errno == EINTR) {
+			continue;
+		}
+		if (chunk < 0) {
+			break;
+		}
+		if (chunk == 0) {
+			return text;
+		}
+		*len += chunk;
+	}
+
+	free(text);
+	return NULL;
+}
+
+/*
+* Convert the .mif text on <in_fd> to a raw image of <byte_order> words on
+* <out_fd>, decoding on up to <jobs> threads. Regular output files are sized
+* and mapped, so the words are stored straight at their final offsets. Return
+* the depth, or -1.
+*/
+long long generate_bin(int in_fd, int out_fd, enum mif_byte_order byte_order,
+		       unsigned int jobs)
+{
+	size_t text_len = 0;
+	bool text_mapped = false;
+	char *text = load_text(in_fd, &text_len, &text_mapped);
+	if (text == NULL) {
+		warn("reading .mif file");
+		return -1;
+	}
+
+	long long retval = -1;
+	byte *image = NULL;
+	size_t image_len = 0;
+	bool image_mapped = false;
+	struct decode_job *slices = NULL;
+	pthread_t *threads = NULL;
+
+	unsigned long error_line = 0;
+	struct mif_loader *loader = mif_loader_open_text(text, text_len, jobs,
+							 &error_line);
+	if (loader == NULL) {
+		if (errno == EINVAL) {
+			warnx("bad .mif file at line %lu", error_line);
+		} else {
+			warn("indexing .mif file");
+		}
+		goto cleanup;
+	}
+
+	const long long depth = mif_loader_depth(loader);
+	const unsigned int width = mif_loader_width(loader);
+	if (!mif_swap_words(NULL, 0, width, byte_order)) {
+		warn("byte order for %u-bit words", width);
+		goto cleanup;
+	}
+	image_len = (depth * width + 7) / 8;
+	if (positional_output(out_fd) && image_len > 0
+	    && ftruncate(out_fd, image_len) == 0) {
+		void *map = mmap(NULL, image_len, PROT_READ | PROT_WRITE,
+				 MAP_SHARED, out_fd, 0);
+		if (map != MAP_FAILED) {
+			image = map;
+			image_mapped = true;
+		}
+	}
+	if (image == NULL && (image = malloc(image_len + 1)) == NULL) {
+		warn("allocating output image");
+		goto cleanup;
+	}
+
+	// Slices of a multiple of 8 words, so packed slices start on a byte
+	long long slice_words = depth / jobs / 8 * 8;
+	if (slice_words == 0) {
+		jobs = 1;
+	}
+	slices = calloc(jobs, sizeof(struct decode_job));
+	threads = calloc(jobs, sizeof(pthread_t));
+	if (slices == NULL || threads == NULL) {
+		warn("allocating decoder state");
+		goto cleanup;
+	}
+
+	// Equal address slices, one per thread
+	for (unsigned int idx = 0; idx < jobs; ++idx) {
+		slices[idx].loader = loader;
+		slices[idx].width = width;
+		slices[idx].byte_order = byte_order;
+		slices[idx].first = slice_words * idx;
+		slices[idx].count = (idx + 1 < jobs ? slice_words
+				     : depth - slices[idx].first);
+		slices[idx].image = image + slices[idx].first * width / 8;
+	}
+	unsigned int nthreads = 1;
+	for (; nthreads < jobs; ++nthreads) {
+		errno = pthread_create(&threads[nthreads], NULL, decode_worker,
+				       &slices[nthreads]);
+		if (errno != 0) {
+			break;
+		}
+	}
+	// The calling thread takes the first slice and any that could not
+	// get a thread of their own
+	for (unsigned int idx = 0; idx < jobs; idx = (idx == 0 ? nthreads
+						      : idx + 1)) {
+		(void)decode_worker(&slices[idx]);
+	}
+	for (unsigned int idx = 1; idx < nthreads; ++idx) {
+		(void)pthread_join(threads[idx], NULL);
+	}
+
+	for (unsigned int idx = 0; idx < jobs; ++idx) {
+		if (slices[idx].decoded != slices[idx].count) {
+			warnx("bad .mif record at line %lu",
+			      mif_loader_line(loader, slices[idx].first
+					      + slices[idx].decoded));
+			goto cleanup;
+		}
+	}
+
+	if (!image_mapped && !write_all(out_fd, image, image_len)) {
+		warn("writing binary image");
+		goto cleanup;
+	}
+	retval = depth;
+
+ cleanup:
+	if (image_mapped) {
+		if (munmap(image, image_len) != 0) {
+			warn("writing binary image");
+			retval = -1;
+		}
+	} else {
+		free(image);
+	}
+	free(slices);
+	free(threads);
+	mif_loader_close(loader);
+	if (text_mapped) {
+		(void)munmap(text, text_len);
+	} else {
+		free(text);
+	}
+	return retval;
+}
+
+//////////////////////////////////// Batch ////////////////////////////////////
+
+/*
+* --batch converts every file listed in a job file in one process. Each line
+* holds "<in_file> <out_file> <depth> <width>", separated by blanks, with "-"
+* as the depth for the whole file; blank lines and lines starting with '#'
+* are skipped. The other options apply to every job.
+*
+* The jobs are sorted by input size and dealt out to the workers in turn, so
+* each worker owns a contiguous range of the list, largest first. A worker
+* takes jobs from the front of its own range; once that is empty, it steals
+* from the back of the others'. Both ends of a range live in one atomic word,
+* so taking and stealing are a single compare-and-swap. Every worker keeps
+* one arena for all of its jobs.
+*/
+struct batch_job {
+	char *text;		// the line, cut into the paths
+	const char *in_filename;
+	const char *out_filename;
+	long long depth;
+	unsigned int width;
+	unsigned long line;
+	off_t size;
+};
+
+struct batch {
+	const char *filename;
+	const struct mif_config *config;
+	bool uring;
+	struct batch_job *jobs;
+	size_t njobs;
+
+	_Atomic uint64_t *ranges;	// per worker: end << 32 | first
+	unsigned int nworkers;
+	atomic_size_t failures;
+};
+
+struct batch_worker {
+	struct batch *batch;
+	unsigned int idx;
+};
+
+/*
+* Take the first job of <*range> if <front>, else the last one; return its
+* index, or -1 if the range is empty
+*/
+static inline long long take_job(_Atomic uint64_t *range, bool front)
+{
+	uint64_t bounds = atomic_load_explicit(range, memory_order_relaxed);
+	while (true) {
+		uint64_t first = bounds & UINT32_MAX;
+		uint64_t end = bounds >> 32;
+		if (first >= end) {
+			return -1;
+		}
+
+		uint64_t taken = (front ? first : end - 1);
+		uint64_t rest = (front ? (end << 32) | (first + 1)
+				 : ((end - 1) << 32) | first);
+		if (atomic_compare_exchange_weak(range, &bounds, rest)) {
+			return taken;
+		}
+	}
+}
+
+/*
+* Convert one job with the buffers of <arena>; return false on failure
+*/
+bool run_batch_job(const struct batch *batch, const struct batch_job *job,
+		   struct arena *arena)
+{
+	int in_fd = open(job->in_filename, O_RDONLY);
+	if (in_fd < 0) {
+		warn(ERROR_MSG[FILE_OPEN_FAILURE], job->in_filename);
+		return false;
+	}
+	int out_fd = open_output(job->out_filename);
+	if (out_fd < 0) {
+		warn(ERROR_MSG[FILE_OPEN_FAILURE], job->out_filename);
+		(void)safe_close(&in_fd);
+		return false;
+	}
+
+	struct mif_config config = *batch->config;
+	config.depth = job->depth;
+	config.width = job->width;
+	bool retval = (generate_mif(in_fd, out_fd, &config, 1, arena) >= 0);
+
+	(void)safe_close(&in_fd);
+	if (!safe_close(&out_fd)) {
+		warn(ERROR_MSG[FILE_CLOSE_FAILURE], job->out_filename);
+		retval = false;
+	}
+	return retval;
+}
+
+void *batch_worker(void *arg)
+{
+	const struct batch_worker *worker = arg;
+	struct batch *batch = worker->batch;
+
+	struct arena arena;
+	if (!arena_init(&arena, batch->uring)) {
+		warn("allocating buffers");
+		arena_destroy(&arena);
+		return NULL;	// the other workers take over its jobs
+	}
+
+	while (true) {
+		long long job_idx = take_job(&batch->ranges[worker->idx], true);
+		for (unsigned int step = 1; job_idx < 0
+		     && step < batch->nworkers; ++step) {
+			unsigned int victim = (worker->idx + step)
+			    % batch->nworkers;
+			job_idx = take_job(&batch->ranges[victim], false);
+		}
+		if (job_idx < 0) {
+			break;	// no worker has any left
+		}
+
+		const struct batch_job *job = &batch->jobs[job_idx];
+		if (!run_batch_job(batch, job, &arena)) {
+			warnx("%s:%lu: job failed", batch->filename, job->line);
+			atomic_fetch_add(&batch->failures, 1);
+		}
+	}
+
+	arena_destroy(&arena);
+	return NULL;
+}
+
+static int compare_job_sizes(const void *lhs, const void *rhs)
+{
+	off_t lhs_size = ((const struct batch_job *)lhs)->size;
+	off_t rhs_size = ((const struct batch_job *)rhs)->size;
+	return (lhs_size < rhs_size) - (lhs_size > rhs_size);
+}
+
+/*
+* Read the job file <filename>; exit on a malformed line
+*/
+struct batch_job *read_batch(const char *filename, size_t *njobs)
+{
+	FILE *file = fopen(filename, "r");
+	if (file == NULL) {
+		err(FILE_OPEN_FAILURE, ERROR_MSG[FILE_OPEN_FAILURE], filename);
+	}
+
+	struct batch_job *jobs = NULL;
+	size_t cap = 0;
+	*njobs = 0;
+
+	char *text = NULL;
+	size_t text_cap = 0;
+	unsigned long line = 0;
+	while (getline(&text, &text_cap, file) >= 0) {
+		++line;
+
+		char *save = NULL;
+		char *fields[5] = { NULL };
+		size_t nfields = 0;
+		for (char *field = strtok_r(text, " \t\r\n", &save);
+		     field != NULL && nfields < 5;
+		     field = strtok_r(NULL, " \t\r\n", &save)) {
+			fields[nfields++] = field;
+		}
+		if (nfields == 0 || fields[0][0] == '#') {
+			continue;
+		}
+		if (nfields != 4) {
+			errx(INVALID_ARGUMENTS, "%s:%lu: expected "
+			     "<in_file> <out_file> <depth> <width>",
+			     filename, line);
+		}
+
+		if (*njobs == cap) {
+			cap = (cap > 0 ? 2 * cap : 64);
+			jobs = realloc(jobs, cap * sizeof(struct batch_job));
+			if (jobs == NULL || cap > UINT32_MAX) {
+				err(GENRATOR_FAILURE, "reading job file");
+			}
+		}
+
+		struct batch_job *job = &jobs[(*njobs)++];
+		job->line = line;
+		job->depth = (strcmp(fields[2], "-") != 0
+			      ? str_to_ll(fields[2]) : -1);
+		if (job->depth < 0 && strcmp(fields[2], "-") != 0) {
+			err(BAD_NUMBER_FORMAT, "%s:%lu: depth \"%s\"",
+			    filename, line, fields[2]);
+		}
+		job->width = str_to_uint(fields[3]);
+		if (errno != 0 || job->width == 0) {
+			errno = (errno != 0 ? errno : ERANGE);
+			err(BAD_NUMBER_FORMAT, "%s:%lu: width \"%s\"",
+			    filename, line, fields[3]);
+		}
+
+		// The fields point into <text>, which the job keeps
+		job->text = text;
+		job->in_filename = fields[0];
+		job->out_filename = fields[1];
+		text = NULL;
+		text_cap = 0;
+
+		struct stat file_stat;
+		job->size = (stat(job->in_filename, &file_stat) == 0
+			     ? file_stat.st_size : 0);
+	}
+
+	bool failed = ferror(file);
+	free(text);
+	(void)fclose(file);
+	if (failed) {
+		err(GENRATOR_FAILURE, "reading job file");
+	}
+	return jobs;
+}
+
+/*
+* Convert every job of the job file <filename> on up to <nworkers> threads,
+* through io_uring if <uring>. Return the number of failed jobs.
+*/
+size_t generate_batch(const char *filename, const struct mif_config *config,
+		      unsigned int nworkers, bool uring)
+{
+	struct batch batch;
+	batch.filename = filename;
+	batch.config = config;
+	batch.uring = uring;
+	batch.jobs = read_batch(filename, &batch.njobs);
+	if (nworkers > batch.njobs) {
+		nworkers = (batch.njobs > 0 ? batch.njobs : 1);
+	}
+	batch.nworkers = nworkers;
+	atomic_init(&batch.failures, 0);
+
+	// Deal the jobs out largest first: worker w gets sorted jobs w,
+	// w + nworkers, ..., contiguously
+	struct batch_job *sorted = malloc((batch.njobs + 1)
+					  * sizeof(struct batch_job));
+	batch.ranges = calloc(nworkers, sizeof(*batch.ranges));
+	struct batch_worker *workers = calloc(nworkers,
+					      sizeof(struct batch_worker));
+	pthread_t *threads = calloc(nworkers, sizeof(pthread_t));
+	if (sorted == NULL || batch.ranges == NULL || workers == NULL
+	    || threads == NULL) {
+		err(GENRATOR_FAILURE, "allocating batch state");
+	}
+
+	qsort(batch.jobs, batch.njobs, sizeof(struct batch_job),
+	      compare_job_sizes);
+	size_t first = 0;
+	for (unsigned int idx = 0; idx < nworkers; ++idx) {
+		size_t count = batch.njobs / nworkers
+		    + (idx < batch.njobs % nworkers);
+		for (size_t pos = 0; pos < count; ++pos) {
+			sorted[first + pos] = batch.jobs[idx + pos * nworkers];
+		}
+		atomic_init(&batch.ranges[idx],
+			    (uint64_t)(first + count) << 32 | first);
+		workers[idx].batch = &batch;
+		workers[idx].idx = idx;
+		first += count;
+	}
+	free(batch.jobs);
+	batch.jobs = sorted;
+
+	// The calling thread is worker 0
+	unsigned int nthreads = 1;
+	for (; nthreads < nworkers; ++nthreads) {
+		errno = pthread_create(&threads[nthreads], NULL, batch_worker,
+				       &workers[nthreads]);
+		if (errno != 0) {
+			warn("starting worker thread");
+			break;
+		}
+	}
+	(void)batch_worker(&workers[0]);
+	for (unsigned int idx = 1; idx < nthreads; ++idx) {
+		(void)pthread_join(threads[idx], NULL);
+	}
+
+	// Jobs of workers that could not allocate their arena
+	size_t failures = atomic_load(&batch.failures);
+	for (unsigned int idx = 0; idx < nworkers; ++idx) {
+		uint64_t range = atomic_load(&batch.ranges[idx]);
+		failures += (range >> 32) - (range & UINT32_MAX);
+	}
+
+	for (size_t idx = 0; idx < batch.njobs; ++idx) {
+		free(batch.jobs[idx].text);
+	}
+	free(batch.jobs);
+	free(batch.ranges);
+	free(workers);
+	free(threads);
+	return failures;
+}
+
+//////////////////////////////////// Main /////////////////////////////////////
+
+int main(int argc, char *argv[])
+{
+	// Command line parameters
+	long long depth = -1;
+	unsigned int width = 8;
+	const char *in_filename = "-";
+	const char *out_filename = NULL;
+	long long jobs = -1;
+	int address_radix = MIF_RADIX_HEX;
+	int data_radix = MIF_RADIX_HEX;
+	unsigned int words_per_line = 1;
+	int byte_order = MIF_ORDER_LITTLE;
+	bool compress = false;
+	bool reverse = (strcmp(basename(argv[0]), "mif2bin") == 0);
+	const char *batch_filename = NULL;
+	bool uring = false;
+
+	// Parse command line arguments
+	char chr = '\0';
+	while ((chr =
+		getopt_long(argc, argv, OPTSTRING, LONG_OPTIONS, NULL)) >= 0) {
+		switch (chr) {
+		case 'w':
+			width = str_to_uint(optarg);
+			if (errno != 0 || width == 0) {
+				errno = (errno != 0 ? errno : ERANGE);
+				err(BAD_NUMBER_FORMAT,
+				    ERROR_MSG[BAD_NUMBER_FORMAT], optarg);
+			}
+			break;
+
+		case 'd':
+			depth = str_to_ll(optarg);
+			if (depth < 0) {
+				err(BAD_NUMBER_FORMAT,
+				    ERROR_MSG[BAD_NUMBER_FORMAT], optarg);
+			}
+			break;
+
+		case 'o':
+			out_filename = optarg;
+			break;
+
+		case 'A':
+			address_radix = str_to_radix(optarg);
+			if (address_radix < 0) {
+				err(INVALID_ARGUMENTS, "radix \"%s\"", optarg);
+			}
+			break;
+
+		case 'D':
+			data_radix = str_to_radix(optarg);
+			if (data_radix < 0) {
+				err(INVALID_ARGUMENTS, "radix \"%s\"", optarg);
+			}
+			break;
+
+		case 'l':
+			words_per_line = str_to_uint(optarg);
+			if (errno != 0 || words_per_line == 0) {
+				errno = (errno != 0 ? errno : ERANGE);
+				err(BAD_NUMBER_FORMAT,
+				    ERROR_MSG[BAD_NUMBER_FORMAT], optarg);
+			}
+			break;
+
+		case 'b':
+			byte_order = str_to_byte_order(optarg);
+			if (byte_order < 0) {
+				err(INVALID_ARGUMENTS, "byte order \"%s\"",
+				    optarg);
+			}
+			break;
+
+		case 'c':
+			compress = true;
+			break;
+
+		case 'j':
+			jobs = str_to_ll(optarg);
+			if (jobs < 1 || jobs > UINT16_MAX) {
+				errno = (errno != 0 ? errno : ERANGE);
+				err(BAD_NUMBER_FORMAT,
+				    ERROR_MSG[BAD_NUMBER_FORMAT], optarg);
+			}
+			break;
+
+		case 'r':
+			reverse = true;
+			break;
+
+		case 'U':
+			uring = true;
+			break;
+
+		case 'B':
+			batch_filename = optarg;
+			break;
+
+		case 'h':
+			(void)dprintf(STDERR_FILENO, HELP_MESSAGE);
+			return EXIT_SUCCESS;
+
+		case '?':
+		default:
+			(void)dprintf(STDERR_FILENO, "\n%s", HELP_MESSAGE);
+			return INVALID_ARGUMENTS;
+		}
+	}
+
+	if (compress && words_per_line > 1) {
+		errno = EINVAL;
+		err(INVALID_ARGUMENTS, "ranges with several words per line");
+	}
+
+	if (jobs < 0) {
+		jobs = available_cpus();
+	}
+
+	struct mif_config config;
+	mif_config_init(&config, depth, width);
+	config.address_radix = address_radix;
+	config.data_radix = data_radix;
+	config.words_per_line = words_per_line;
+	config.byte_order = byte_order;
+	config.compress = compress;
+
+	if (batch_filename != NULL) {
+		if (reverse || out_filename != NULL || optind < argc) {
+			errno = EINVAL;
+			err(INVALID_ARGUMENTS,
+			    "--batch with an input file, -o or -r");
+		}
+		return (generate_batch(batch_filename, &config, jobs, uring) > 0
+			? GENRATOR_FAILURE : EXIT_SUCCESS);
+	}
+
+	if (optind < argc && argc - optind == 1) {
+		in_filename = argv[optind++];
+	} else if (optind < argc) {
+		err(INVALID_ARGUMENTS, ERROR_MSG[INVALID_ARGUMENTS]);
+	}
+
+	// Open files
+	int in_fd = (strcmp(in_filename, "-") != 0 ? open(in_filename, O_RDONLY)
+		     : STDIN_FILENO);
+
+	if (in_fd < 0) {
+		err(FILE_OPEN_FAILURE, ERROR_MSG[FILE_OPEN_FAILURE],
+		    in_filename);
+	}
+
+	int out_fd = (out_filename != NULL ? open_output(out_filename)
+		      : STDOUT_FILENO);
+
+	if (out_fd < 0) {
+		int saved_errno = errno;
+		(void)safe_close(&in_fd);
+
+		errno = saved_errno;
+		err(FILE_OPEN_FAILURE, ERROR_MSG[FILE_OPEN_FAILURE],
+		    out_filename);
+	}
+
+	// Generate .mif file, or the binary image in reverse mode
+	struct arena arena;
+	if (!reverse && !arena_init(&arena, uring)) {
+		err(GENRATOR_FAILURE, "allocating buffers");
+	}
+	long long words_written = (reverse
+				   ? generate_bin(in_fd, out_fd, byte_order, jobs)
+				   : generate_mif(in_fd, out_fd, &config, jobs,
+						  &arena));
+	if (!reverse) {
+		arena_destroy(&arena);
+	}
+	if (words_written < 0 || words_written != depth) {
 		int saved_errno = errno;
 		(void)safe_close(&in_fd);
 		(void)safe_close(&out_fd);
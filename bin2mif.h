@@ -0,0 +1,274 @@
+#ifndef BIN2MIF_H
+#define BIN2MIF_H
+
+/*
+* libbin2mif: streaming conversion of raw binary images to Altera/Intel .mif
+* memory initialization files, and random access to the words of existing ones
+*/
+
+#include <stdbool.h>		// bool
+#include <stddef.h>		// size_t
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Exported from the shared library, which is built with -fvisibility=hidden
+#ifdef __GNUC__
+#define MIF_API __attribute__((visibility("default")))
+#else
+#define MIF_API
+#endif
+
+//////////////////////////////// Configuration ////////////////////////////////
+
+#define MIF_TRAILER "END;\n"	// last line of every .mif file
+#define MIF_MAX_DECIMAL_WIDTH 4096	// bits; widest DEC or UNS data
+
+/*
+* Numbers are zero-padded to a fixed number of digits: addresses to those of
+* depth - 1, data to those of the widest value. DEC data is two's complement
+* with a '-' or a '0' in front.
+*/
+enum mif_radix {
+	MIF_RADIX_BIN,
+	MIF_RADIX_OCT,
+	MIF_RADIX_DEC,
+	MIF_RADIX_UNS,
+	MIF_RADIX_HEX
+};
+
+/*
+* Byte order of the binary words. The swapped orders store a word as 32-bit
+* or 16-bit groups, most significant group first, each group little-endian.
+* Orders other than little-endian need a width that is a multiple of 8 and,
+* for the swapped ones, of 32 or 16 bits.
+*/
+enum mif_byte_order {
+	MIF_ORDER_LITTLE,
+	MIF_ORDER_BIG,
+	MIF_ORDER_WORD_SWAPPED,
+	MIF_ORDER_HALF_WORD_SWAPPED
+};
+
+struct mif_config {
+	long long depth;	// number of words
+	unsigned int width;	// bits per word, at least 1
+	enum mif_radix address_radix;
+	enum mif_radix data_radix;
+	unsigned int words_per_line;	// values per record, at least 1
+	enum mif_byte_order byte_order;	// of the input words
+	bool compress;		// collapse runs of equal words into ranges
+};
+
+/*
+* Fill <config> with <depth> little-endian words of <width> bits, HEX radices
+* and one record per word
+*/
+MIF_API
+void mif_config_init(struct mif_config *config, long long depth,
+		     unsigned int width);
+
+/*
+* Convert <nwords> words of <width> bits between <order> and little-endian,
+* in place. Return false with errno EINVAL if <order> does not apply to
+* <width>.
+*/
+MIF_API
+bool mif_swap_words(void *words, size_t nwords, unsigned int width,
+		    enum mif_byte_order order);
+
+/////////////////////////////////// Encoder ///////////////////////////////////
+
+/*
+* An encoder turns a stream of binary words into the text of a .mif file:
+* header, records and END; trailer. Input is fed in spans of any length; words
+* split across spans are carried over. Output is drained into caller-provided
+* buffers of any size.
+*
+* Words are in the configured byte order. Words of a width that is not a
+* multiple of 8 are bit-packed: word i is bits [i * width, (i + 1) * width) of
+* the input, least significant bit first.
+*/
+struct mif_encoder;
+
+/*
+* Return a new encoder, or NULL with errno set (EINVAL for an unsupported
+* configuration, including a depth * width that does not fit a long long,
+* decimal data wider than MIF_MAX_DECIMAL_WIDTH, ranges with several words
+* per line or a byte order that does not apply to the width; ENOMEM)
+*/
+MIF_API
+struct mif_encoder *mif_encoder_create(const struct mif_config *config);
+
+MIF_API
+void mif_encoder_destroy(struct mif_encoder *enc);
+
+/*
+* Consume input from <*src> (<*src_len> bytes) and write up to <dest_len>
+* bytes of output to <dest>; <*src> and <*src_len> are advanced past the
+* consumed input. Return the number of bytes written. Fewer than <dest_len>
+* bytes are written only when the encoder needs more input or is done.
+* Input beyond <depth> words is left unconsumed.
+*/
+MIF_API
+size_t mif_encoder_encode(struct mif_encoder *enc, const void **src,
+			  size_t *src_len, char *dest, size_t dest_len);
+
+/*
+* Declare the end of the input. The remaining output (the last range and the
+* trailer) is drained with further mif_encoder_encode calls; a trailing
+* partial word is dropped.
+*/
+MIF_API
+void mif_encoder_finish(struct mif_encoder *enc);
+
+/*
+* True once all output, trailer included, has been drained
+*/
+MIF_API
+bool mif_encoder_done(const struct mif_encoder *enc);
+
+/*
+* Number of words consumed so far
+*/
+MIF_API
+long long mif_encoder_words(const struct mif_encoder *enc);
+
+/*
+* Output callback: return false to stop encoding, errno describing the failure
+*/
+typedef bool (*mif_sink)(void *context, const char *data, size_t len);
+
+/*
+* Encode <src_len> bytes from <src>, passing the output to <sink>. Return false
+* if <sink> fails, or with errno ENOMEM if the output buffer, allocated on the
+* first call, cannot be.
+*/
+MIF_API
+bool mif_encoder_write(struct mif_encoder *enc, const void *src,
+		       size_t src_len, mif_sink sink, void *context);
+
+/*
+* Finish the input and pass all remaining output to <sink>
+*/
+MIF_API
+bool mif_encoder_close(struct mif_encoder *enc, mif_sink sink, void *context);
+
+///////////////////////////// Fixed-length records ////////////////////////////
+
+/*
+* Unless ranges are enabled, every record has the same length (only the last
+* one may hold fewer than words_per_line words), so the records of any
+* address range can be formatted independently, e.g. by several threads
+* straight into their final place in the output.
+*/
+
+/*
+* Length in bytes of every full record, or 0 when ranges are enabled
+*/
+MIF_API
+size_t mif_encoder_record_len(const struct mif_encoder *enc);
+
+/*
+* Length in bytes of the records of <nwords> words from the start of a
+* record, or 0 when ranges are enabled
+*/
+MIF_API
+size_t mif_encoder_records_len(const struct mif_encoder *enc, long long nwords);
+
+/*
+* Write the records of <nwords> words starting at address <first_addr> to
+* <dest>, which has room for mif_encoder_records_len bytes. <first_addr> is a
+* multiple of words_per_line, and the last record is short if <nwords> is not.
+* Does not change the encoder and may be called from several threads at once.
+* Bit-packed <words> must start on a byte, i.e. <first_addr> is also a
+* multiple of 8. Bit-packed or byte-swapped words are staged through a heap
+* buffer, and false is returned with errno set if it cannot be allocated.
+*/
+MIF_API
+bool mif_encoder_format(const struct mif_encoder *enc, char *dest,
+			const void *words, size_t nwords, long long first_addr);
+
+/*
+* Account for <nwords> records the caller formatted with mif_encoder_format
+* after draining the header; the stream continues after them
+*/
+MIF_API
+void mif_encoder_advance(struct mif_encoder *enc, long long nwords);
+
+/////////////////////////////////// Loader ////////////////////////////////////
+
+/*
+* A loader gives random access to the words of a .mif file. Files laid out
+* the way bin2mif writes them (one fixed-length record per address, in any
+* radices) are decoded in place: any address is found in O(1). Other files
+* are indexed once, on up to <jobs> threads, with one small entry per group
+* of records; values are checked and decoded when read. Where records
+* overlap, the last one wins, and addresses no record sets read as zero.
+* Words are little-endian, ceil(width / 8) bytes each, with any unused high
+* bits clear.
+*/
+struct mif_loader;
+
+/*
+* Map and index the .mif file at <path>. Return NULL with errno set on
+* failure; for a malformed file, errno is EINVAL and <*error_line> (unless
+* NULL) is the offending line.
+*/
+MIF_API
+struct mif_loader *mif_loader_open(const char *path, unsigned int jobs,
+				   unsigned long *error_line);
+
+/*
+* Same over <len> bytes of .mif text, which must outlive the loader
+*/
+MIF_API
+struct mif_loader *mif_loader_open_text(const char *text, size_t len,
+					unsigned int jobs,
+					unsigned long *error_line);
+
+MIF_API
+void mif_loader_close(struct mif_loader *loader);
+
+MIF_API
+long long mif_loader_depth(const struct mif_loader *loader);
+
+MIF_API
+unsigned int mif_loader_width(const struct mif_loader *loader);
+
+/*
+* True if the file has fixed-length records and is read without an index
+*/
+MIF_API
+bool mif_loader_is_fixed(const struct mif_loader *loader);
+
+/*
+* Decode the <count> words from address <first> on into <image>. Return
+* <count>, or the number of words decoded before a malformed record, or -1
+* for a bad address range; errno is set when fewer than <count> words are
+* decoded. Does not change the loader and may be called from several threads
+* at once.
+*/
+MIF_API
+long long mif_loader_decode(const struct mif_loader *loader, void *image,
+			    long long first, long long count);
+
+/*
+* Decode the word at <addr> into <word>
+*/
+MIF_API
+bool mif_loader_read(const struct mif_loader *loader, long long addr,
+		     void *word);
+
+/*
+* Line of the record that sets <addr>, or 0 if there is none
+*/
+MIF_API
+unsigned long mif_loader_line(const struct mif_loader *loader, long long addr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif				// BIN2MIF_H
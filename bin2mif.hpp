@@ -0,0 +1,297 @@
+#ifndef BIN2MIF_HPP
+#define BIN2MIF_HPP
+
+/*
+* C++20 wrapper over libbin2mif with the word width fixed at compile time.
+*
+* bin2mif::encoder<Width> formats fixed-length records itself: every word is
+* encoded by a fully unrolled sequence of table lookups and the staging
+* buffers are fixed-size arrays. The header, the trailer and range records
+* still come from the C encoder.
+*/
+
+#include "bin2mif.h"
+
+#include <algorithm>		// std::copy_n
+#include <array>		// std::array
+#include <cerrno>		// errno
+#include <cstddef>		// std::byte, std::size_t
+#include <cstring>		// std::memcpy
+#include <iterator>		// std::back_inserter
+#include <memory>		// std::unique_ptr
+#include <span>			// std::span
+#include <string>		// std::string
+#include <system_error>		// std::system_error
+#include <utility>		// std::index_sequence
+
+namespace bin2mif {
+
+namespace detail {
+
+struct hex_table {
+	std::array<std::array<char, 2>, 256> digits{};
+
+	constexpr hex_table()
+	{
+		constexpr char hex_digits[] = "0123456789abcdef";
+		for (std::size_t value = 0; value < 256; ++value) {
+			digits[value][0] = hex_digits[value >> 4];
+			digits[value][1] = hex_digits[value & 0xf];
+		}
+	}
+};
+
+inline constexpr hex_table HEX_TABLE{};
+
+/*
+* Write the word, most significant byte first; one lookup per byte, unrolled
+*/
+template <std::size_t WordSize, std::size_t... Idx>
+inline void encode_word(char *dest, const std::byte *word,
+			std::index_sequence<Idx...>)
+{
+	((std::memcpy(dest + 2 * Idx,
+		      HEX_TABLE.digits[std::to_integer<unsigned int>
+				       (word[WordSize - 1 - Idx])].data(), 2)),
+	 ...);
+}
+
+constexpr unsigned int hex_len(unsigned long long num)
+{
+	unsigned int len = 1;
+	for (num >>= 4; num > 0; num >>= 4) {
+		++len;
+	}
+	return len;
+}
+
+struct encoder_deleter {
+	void operator()(mif_encoder *enc) const
+	{
+		mif_encoder_destroy(enc);
+	}
+};
+
+}				// namespace detail
+
+template <unsigned int Width>
+class encoder {
+	static_assert(Width == 8 || Width == 16 || Width == 32 || Width == 64
+		      || Width == 128 || Width == 256 || Width == 512
+		      || Width == 1024, "unsupported word width");
+
+public:
+	static constexpr std::size_t word_size = Width / 8;
+	static constexpr std::size_t data_len = 2 * word_size;
+
+	/*
+	* Throws std::system_error when the C encoder cannot be created
+	*/
+	explicit encoder(long long depth, bool compress = false)
+	    : depth_(depth),
+	      addr_len_(detail::hex_len(depth > 0 ? depth - 1 : 0)),
+	      record_len_(addr_len_ + 3 + data_len + 2)
+	{
+		mif_config config;
+		mif_config_init(&config, depth, Width);
+		config.compress = compress;
+
+		enc_.reset(mif_encoder_create(&config));
+		if (!enc_) {
+			throw std::system_error(errno, std::generic_category(),
+						"mif_encoder_create");
+		}
+
+		addr_template_.fill('0');
+		std::memcpy(addr_template_.data() + addr_len_, " : ", 3);
+	}
+
+	/*
+	* Encode <input>, writing the output through <out>
+	*/
+	template <class OutputIt>
+	OutputIt write(std::span<const std::byte> input, OutputIt out)
+	{
+		out = drain(out);
+		if (mif_encoder_record_len(enc_.get()) == 0) {
+			return encode(input, out);	// ranges
+		}
+
+		// Complete a word split across spans
+		if (partial_len_ > 0) {
+			std::size_t len = std::min(word_size - partial_len_,
+						   input.size());
+			std::copy_n(input.begin(), len,
+				    partial_.begin() + partial_len_);
+			partial_len_ += len;
+			input = input.subspan(len);
+			if (partial_len_ < word_size) {
+				return out;
+			}
+
+			partial_len_ = 0;
+			out = format(partial_.data(), 1, out);
+		}
+
+		std::size_t nwords = input.size() / word_size;
+		out = format(input.data(), nwords, out);
+
+		input = input.subspan(nwords * word_size);
+		if (next_addr_ < depth_) {
+			std::copy(input.begin(), input.end(), partial_.begin());
+			partial_len_ = input.size();
+		}
+		return out;
+	}
+
+	/*
+	* Finish the input and write the remaining output through <out>
+	*/
+	template <class OutputIt>
+	OutputIt close(OutputIt out)
+	{
+		out = drain(out);
+		if (mif_encoder_record_len(enc_.get()) > 0) {
+			mif_encoder_advance(enc_.get(), next_addr_);
+		}
+		mif_encoder_finish(enc_.get());
+		return encode({}, out);
+	}
+
+	void write(std::span<const std::byte> input, std::string &out)
+	{
+		(void)write(input, std::back_inserter(out));
+	}
+
+	void close(std::string &out)
+	{
+		(void)close(std::back_inserter(out));
+	}
+
+	/*
+	* Number of words consumed so far
+	*/
+	long long words() const
+	{
+		return mif_encoder_record_len(enc_.get()) > 0
+		    ? next_addr_ : mif_encoder_words(enc_.get());
+	}
+
+private:
+	static constexpr std::size_t BLOCK_WORDS = 64;
+	static constexpr std::size_t MAX_RECORD_LEN = 16 + 3 + data_len + 2;
+
+	/*
+	* Write the header before the first record
+	*/
+	template <class OutputIt>
+	OutputIt drain(OutputIt out)
+	{
+		if (!header_done_) {
+			header_done_ = true;
+			out = encode({}, out);
+		}
+		return out;
+	}
+
+	/*
+	* Run the C encoder until it wants more input or is done
+	*/
+	template <class OutputIt>
+	OutputIt encode(std::span<const std::byte> input, OutputIt out)
+	{
+		const void *src = input.data();
+		std::size_t src_len = input.size();
+		std::array<char, 4096> buffer;
+
+		while (true) {
+			std::size_t len =
+			    mif_encoder_encode(enc_.get(), &src, &src_len,
+					       buffer.data(), buffer.size());
+			out = std::copy_n(buffer.data(), len, out);
+			if (len < buffer.size()) {
+				return out;
+			}
+		}
+	}
+
+	template <class OutputIt>
+	OutputIt format(const std::byte *words, std::size_t nwords,
+			OutputIt out)
+	{
+		if (static_cast<long long>(nwords) > depth_ - next_addr_) {
+			nwords = depth_ - next_addr_;
+		}
+
+		std::array<char, BLOCK_WORDS * MAX_RECORD_LEN> buffer;
+		while (nwords > 0) {
+			std::size_t block = std::min(nwords, BLOCK_WORDS);
+			char *dest = buffer.data();
+
+			for (std::size_t idx = 0; idx < block; ++idx) {
+				std::memcpy(dest, addr_template_.data(),
+					    addr_len_ + 3);
+				detail::encode_word<word_size>
+				    (dest + addr_len_ + 3, words,
+				     std::make_index_sequence<word_size>{});
+				std::memcpy(dest + record_len_ - 2, ";\n", 2);
+				increment_address();
+
+				dest += record_len_;
+				words += word_size;
+			}
+
+			out = std::copy(buffer.data(), dest, out);
+			next_addr_ += block;
+			nwords -= block;
+		}
+		return out;
+	}
+
+	void increment_address()
+	{
+		for (std::size_t idx = addr_len_; idx > 0; --idx) {
+			char &digit = addr_template_[idx - 1];
+			if (digit == 'f') {
+				digit = '0';
+				continue;
+			}
+			digit = (digit == '9' ? 'a' : digit + 1);
+			return;
+		}
+	}
+
+	std::unique_ptr<mif_encoder, detail::encoder_deleter> enc_;
+	long long depth_;
+	std::size_t addr_len_;
+	std::size_t record_len_;
+
+	std::array<char, 16 + 3> addr_template_;
+	long long next_addr_ = 0;
+	bool header_done_ = false;
+
+	std::array<std::byte, word_size> partial_{};
+	std::size_t partial_len_ = 0;
+};
+
+/*
+* Convert a whole image; the depth defaults to the number of whole words
+*/
+template <unsigned int Width>
+std::string to_mif(std::span<const std::byte> image, long long depth = -1,
+		   bool compress = false)
+{
+	if (depth < 0) {
+		depth = image.size() / encoder<Width>::word_size;
+	}
+
+	std::string out;
+	encoder<Width> enc(depth, compress);
+	enc.write(image, out);
+	enc.close(out);
+	return out;
+}
+
+}				// namespace bin2mif
+
+#endif				// BIN2MIF_HPP
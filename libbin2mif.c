@@ -0,0 +1,3364 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "bin2mif.h"
+
+#include <stdio.h>		// snprintf
+#include <stdbool.h>		// bool
+#include <string.h>		// memcpy, memcmp, memset, memchr, strlen
+#include <strings.h>		// strncasecmp
+#include <limits.h>		// LLONG_MAX, UINT_MAX
+#include <stdint.h>		// uint8_t, uint64_t
+#include <stdlib.h>		// malloc, posix_memalign, free, size_t
+
+#include <errno.h>		// errno, EINVAL, ENOMEM
+#include <fcntl.h>		// open
+#include <unistd.h>		// close
+#include <sys/mman.h>		// mmap, munmap
+#include <sys/stat.h>		// fstat
+
+#include <pthread.h>		// pthread_once, pthread_create, pthread_mutex_*
+#include <stdatomic.h>		// atomic_bool, atomic_load_explicit
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>		// SSSE3, AVX2 and AVX-512 intrinsics
+#endif
+
+//////////////////////////////////// Typedefs /////////////////////////////////
+
+typedef uint8_t byte;
+
+/////////////////////////////////// Constants /////////////////////////////////
+
+#define FORMAT_BLOCK_SIZE 128	// words encoded per kernel call
+#define WIDE_DATA_LEN 128	// digits; longer data is encoded a word at a time
+#define SINK_BUFFER_SIZE (64 << 10)	// bytes handed to a sink at once
+#define HEADER_SIZE 128		// bytes
+#define ADDR_TEMPLATE_SIZE 68	// bytes; 64 address digits and " : "
+#define INDEX_STRIDE 64		// records per sparse index entry
+#define UNPACK_BUFFER_SIZE (16 << 10)	// bytes of words unpacked or swapped at once
+#define BUFFER_ALIGNMENT 64	// bytes; a cache line and the widest vector
+
+///////////////////////////////// Digit tables ////////////////////////////////
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+static char HEX_BYTE_TABLE[256][2];	// byte -> 2 ASCII digits
+static char HEX_PAIR_TABLE[65536][4];	// (high << 8 | low) -> 4 ASCII digits
+static char BIN_BYTE_TABLE[256][8];	// byte -> 8 ASCII bits, MSB first
+static char OCT_GROUP_TABLE[4096][4];	// 12 bits -> 4 ASCII octal digits
+static char DEC_PAIR_TABLE[100][2];	// 0..99 -> 2 ASCII decimal digits
+static signed char DIGIT_VALUE_TABLE[256];	// ASCII digit/letter -> 0..35, or -1
+
+static void init_digit_tables(void)
+{
+	for (unsigned int value = 0; value < 256; ++value) {
+		HEX_BYTE_TABLE[value][0] = HEX_DIGITS[value >> 4];
+		HEX_BYTE_TABLE[value][1] = HEX_DIGITS[value & 0xf];
+	}
+	for (unsigned int value = 0; value < 65536; ++value) {
+		memcpy(HEX_PAIR_TABLE[value], HEX_BYTE_TABLE[value >> 8], 2);
+		memcpy(HEX_PAIR_TABLE[value] + 2, HEX_BYTE_TABLE[value & 0xff],
+		       2);
+	}
+	for (unsigned int value = 0; value < 256; ++value) {
+		for (unsigned int bit = 0; bit < 8; ++bit) {
+			BIN_BYTE_TABLE[value][bit] = '0' + ((value >> (7 - bit)) & 1);
+		}
+	}
+	for (unsigned int value = 0; value < 4096; ++value) {
+		for (unsigned int digit = 0; digit < 4; ++digit) {
+			OCT_GROUP_TABLE[value][digit] =
+			    '0' + ((value >> (3 * (3 - digit))) & 7);
+		}
+	}
+	for (unsigned int value = 0; value < 100; ++value) {
+		DEC_PAIR_TABLE[value][0] = '0' + value / 10;
+		DEC_PAIR_TABLE[value][1] = '0' + value % 10;
+	}
+
+	memset(DIGIT_VALUE_TABLE, -1, sizeof(DIGIT_VALUE_TABLE));
+	for (unsigned int value = 0; value < 10; ++value) {
+		DIGIT_VALUE_TABLE['0' + value] = value;
+	}
+	for (unsigned int value = 0; value < 26; ++value) {
+		DIGIT_VALUE_TABLE['a' + value] = value + 10;
+		DIGIT_VALUE_TABLE['A' + value] = value + 10;
+	}
+}
+
+/*
+* Write the word, most significant byte first, as 2 * <word_size> lowercase
+* hex digits. Return the pointer past the last digit.
+*/
+static inline char *encode_hex_word(char *dest, const byte *word,
+				    size_t word_size)
+{
+	size_t byte_idx = word_size;
+	for (; byte_idx >= 2; byte_idx -= 2) {
+		unsigned int pair = (word[byte_idx - 1] << 8) | word[byte_idx - 2];
+		memcpy(dest, HEX_PAIR_TABLE[pair], 4);
+		dest += 4;
+	}
+	if (byte_idx == 1) {
+		memcpy(dest, HEX_BYTE_TABLE[word[0]], 2);
+		dest += 2;
+	}
+	return dest;
+}
+
+/*
+* Write the word, most significant bit first, as 8 * <word_size> binary
+* digits. Return the pointer past the last digit.
+*/
+static inline char *encode_bin_word(char *dest, const byte *word,
+				    size_t word_size)
+{
+	for (size_t byte_idx = word_size; byte_idx > 0; --byte_idx) {
+		memcpy(dest, BIN_BYTE_TABLE[word[byte_idx - 1]], 8);
+		dest += 8;
+	}
+	return dest;
+}
+
+////////////////////////////////// Hex kernels ////////////////////////////////
+
+/*
+* A hex kernel encodes <nwords> consecutive words into a contiguous run of
+* 2 * <word_size> * <nwords> digits, each word most significant byte first.
+* The vector kernels split nibbles, reverse the bytes of every word with a
+* shuffle and translate to ASCII with a 16-entry shuffle table. Words of a
+* power-of-two size up to the vector width pack several to a vector; wider
+* words are walked a lane at a time from the most significant end, widest
+* lanes first and the tables for the last few bytes. Narrow words of other
+* sizes go through the tables.
+*/
+typedef void (*hex_kernel)(char *dest, const byte *src, size_t nwords,
+			   size_t word_size);
+
+static void hex_encode_scalar(char *dest, const byte *src, size_t nwords,
+			      size_t word_size)
+{
+	for (size_t word_idx = 0; word_idx < nwords; ++word_idx) {
+		dest = encode_hex_word(dest, src, word_size);
+		src += word_size;
+	}
+}
+
+static inline bool is_power_of_two(size_t num)
+{
+	return num != 0 && (num & (num - 1)) == 0;
+}
+
+/*
+* Fill a 16-byte shuffle mask reversing every <group>-byte group of a lane
+* (the whole lane when <group> is 16 or more)
+*/
+static void reverse_mask(byte mask[16], size_t group)
+{
+	if (group > 16) {
+		group = 16;
+	}
+	for (byte idx = 0; idx < 16; ++idx) {
+		mask[idx] = (idx / group) * group + group - 1 - idx % group;
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+
+/*
+* The wide-word walkers below encode <len> bytes of a word, one lane at a
+* time from the most significant end, and return the pointer past the last
+* digit. Each hands what is left below its lanes to the next narrower one;
+* they are inlined into the kernels, so a wider kernel never switches to
+* legacy SSE code in the middle of a word.
+*/
+
+__attribute__((target("ssse3")))
+static inline void hex_store_16(char *dest, __m128i bytes)
+{
+	const __m128i digits = _mm_loadu_si128((const __m128i *)HEX_DIGITS);
+	const __m128i low_mask = _mm_set1_epi8(0x0f);
+
+	__m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), low_mask);
+	__m128i low = _mm_and_si128(bytes, low_mask);
+	high = _mm_shuffle_epi8(digits, high);
+	low = _mm_shuffle_epi8(digits, low);
+
+	_mm_storeu_si128((__m128i *)dest, _mm_unpacklo_epi8(high, low));
+	_mm_storeu_si128((__m128i *)(dest + 16), _mm_unpackhi_epi8(high, low));
+}
+
+__attribute__((target("ssse3")))
+static inline char *hex_encode_lanes_16(char *dest, const byte *src,
+					size_t len)
+{
+	const __m128i mask = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+					   7, 6, 5, 4, 3, 2, 1, 0);
+	for (; len >= 16; len -= 16) {
+		__m128i bytes = _mm_loadu_si128((const __m128i *)
+						(src + len - 16));
+		hex_store_16(dest, _mm_shuffle_epi8(bytes, mask));
+		dest += 32;
+	}
+	return encode_hex_word(dest, src, len);
+}
+
+__attribute__((target("ssse3")))
+static void hex_encode_ssse3(char *dest, const byte *src, size_t nwords,
+			     size_t word_size)
+{
+	if (word_size >= 16) {
+		for (size_t word_idx = 0; word_idx < nwords; ++word_idx) {
+			dest = hex_encode_lanes_16(dest, src, word_size);
+			src += word_size;
+		}
+		return;
+	}
+	if (!is_power_of_two(word_size)) {
+		hex_encode_scalar(dest, src, nwords, word_size);
+		return;
+	}
+
+	byte mask_bytes[16];
+	reverse_mask(mask_bytes, word_size);
+	const __m128i mask = _mm_loadu_si128((const __m128i *)mask_bytes);
+
+	const size_t words_per_vector = 16 / word_size;
+	for (; nwords >= words_per_vector; nwords -= words_per_vector) {
+		__m128i bytes = _mm_loadu_si128((const __m128i *)src);
+		hex_store_16(dest, _mm_shuffle_epi8(bytes, mask));
+		dest += 32;
+		src += 16;
+	}
+	hex_encode_scalar(dest, src, nwords, word_size);
+}
+
+__attribute__((target("avx2")))
+static inline void hex_store_32(char *dest, __m256i bytes)
+{
+	const __m256i digits =
+	    _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)
+							HEX_DIGITS));
+	const __m256i low_mask = _mm256_set1_epi8(0x0f);
+
+	__m256i high = _mm256_and_si256(_mm256_srli_epi16(bytes, 4), low_mask);
+	__m256i low = _mm256_and_si256(bytes, low_mask);
+	high = _mm256_shuffle_epi8(digits, high);
+	low = _mm256_shuffle_epi8(digits, low);
+
+	// Unpacking is per 128-bit lane; put the halves back in order
+	__m256i first = _mm256_unpacklo_epi8(high, low);
+	__m256i second = _mm256_unpackhi_epi8(high, low);
+	_mm256_storeu_si256((__m256i *)dest,
+			    _mm256_permute2x128_si256(first, second, 0x20));
+	_mm256_storeu_si256((__m256i *)(dest + 32),
+			    _mm256_permute2x128_si256(first, second, 0x31));
+}
+
+__attribute__((target("avx2")))
+static inline char *hex_encode_lanes_32(char *dest, const byte *src,
+					size_t len)
+{
+	const __m256i mask = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+					      7, 6, 5, 4, 3, 2, 1, 0,
+					      15, 14, 13, 12, 11, 10, 9, 8,
+					      7, 6, 5, 4, 3, 2, 1, 0);
+	for (; len >= 32; len -= 32) {
+		__m256i bytes = _mm256_loadu_si256((const __m256i *)
+						   (src + len - 32));
+		// Swap the 128-bit lanes
+		bytes = _mm256_permute4x64_epi64(bytes, 0x4e);
+		hex_store_32(dest, _mm256_shuffle_epi8(bytes, mask));
+		dest += 64;
+	}
+	return hex_encode_lanes_16(dest, src, len);
+}
+
+__attribute__((target("avx2")))
+static void hex_encode_avx2(char *dest, const byte *src, size_t nwords,
+			    size_t word_size)
+{
+	if (word_size >= 32 || (word_size > 16 && !is_power_of_two(word_size))) {
+		for (size_t word_idx = 0; word_idx < nwords; ++word_idx) {
+			dest = hex_encode_lanes_32(dest, src, word_size);
+			src += word_size;
+		}
+		return;
+	}
+	if (!is_power_of_two(word_size)) {
+		hex_encode_scalar(dest, src, nwords, word_size);
+		return;
+	}
+
+	byte mask_bytes[16];
+	reverse_mask(mask_bytes, word_size);
+	const __m256i mask =
+	    _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)
+							mask_bytes));
+
+	const size_t words_per_vector = 32 / word_size;
+	for (; nwords >= words_per_vector; nwords -= words_per_vector) {
+		__m256i bytes = _mm256_loadu_si256((const __m256i *)src);
+		hex_store_32(dest, _mm256_shuffle_epi8(bytes, mask));
+		dest += 64;
+		src += 32;
+	}
+	hex_encode_scalar(dest, src, nwords, word_size);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline void hex_store_64(char *dest, __m512i bytes)
+{
+	const __m512i digits =
+	    _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)
+						   HEX_DIGITS));
+	const __m512i low_mask = _mm512_set1_epi8(0x0f);
+
+	__m512i high = _mm512_and_si512(_mm512_srli_epi16(bytes, 4), low_mask);
+	__m512i low = _mm512_and_si512(bytes, low_mask);
+	high = _mm512_shuffle_epi8(digits, high);
+	low = _mm512_shuffle_epi8(digits, low);
+
+	__m512i first = _mm512_unpacklo_epi8(high, low);
+	__m512i second = _mm512_unpackhi_epi8(high, low);
+	const __m512i first_idx = _mm512_setr_epi64(0, 1, 8, 9, 2, 3, 10, 11);
+	const __m512i second_idx =
+	    _mm512_setr_epi64(4, 5, 12, 13, 6, 7, 14, 15);
+	_mm512_storeu_si512(dest,
+			    _mm512_permutex2var_epi64(first, first_idx,
+						      second));
+	_mm512_storeu_si512(dest + 64,
+			    _mm512_permutex2var_epi64(first, second_idx,
+						      second));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline char *hex_encode_lanes_64(char *dest, const byte *src,
+					size_t len)
+{
+	const __m512i mask =
+	    _mm512_broadcast_i32x4(_mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+						 7, 6, 5, 4, 3, 2, 1, 0));
+	for (; len >= 64; len -= 64) {
+		__m512i bytes = _mm512_loadu_si512(src + len - 64);
+		// Reverse the order of the 128-bit lanes
+		bytes = _mm512_shuffle_i64x2(bytes, bytes, 0x1b);
+		hex_store_64(dest, _mm512_shuffle_epi8(bytes, mask));
+		dest += 128;
+	}
+	return hex_encode_lanes_32(dest, src, len);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void hex_encode_avx512(char *dest, const byte *src, size_t nwords,
+			      size_t word_size)
+{
+	if (word_size >= 64 || (word_size > 16 && !is_power_of_two(word_size))) {
+		for (size_t word_idx = 0; word_idx < nwords; ++word_idx) {
+			dest = hex_encode_lanes_64(dest, src, word_size);
+			src += word_size;
+		}
+		return;
+	}
+	if (!is_power_of_two(word_size)) {
+		hex_encode_scalar(dest, src, nwords, word_size);
+		return;
+	}
+
+	byte mask_bytes[16];
+	reverse_mask(mask_bytes, word_size);
+	const __m512i mask =
+	    _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)
+						   mask_bytes));
+
+	const size_t words_per_vector = 64 / word_size;
+	for (; nwords >= words_per_vector; nwords -= words_per_vector) {
+		__m512i bytes = _mm512_loadu_si512(src);
+		if (word_size == 32) {
+			// Swap the 128-bit lanes within each 256-bit word
+			bytes = _mm512_shuffle_i64x2(bytes, bytes, 0xb1);
+		}
+		hex_store_64(dest, _mm512_shuffle_epi8(bytes, mask));
+		dest += 128;
+		src += 64;
+	}
+	hex_encode_scalar(dest, src, nwords, word_size);
+}
+#endif				// HAVE_X86_SIMD
+
+/*
+* Pick the widest kernel the running CPU supports
+*/
+static hex_kernel select_hex_kernel(void)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512bw")) {
+		return hex_encode_avx512;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		return hex_encode_avx2;
+	}
+	if (__builtin_cpu_supports("ssse3")) {
+		return hex_encode_ssse3;
+	}
+#endif
+	return hex_encode_scalar;
+}
+
+////////////////////////////////// Bin kernels ////////////////////////////////
+
+/*
+* A bin kernel encodes <nwords> consecutive words into a contiguous run of
+* 8 * <word_size> * <nwords> digits, each word most significant bit first.
+* The vector kernels put 16 bytes in output order with the same shuffles as
+* the hex kernels, broadcast every byte to the 8 digits it becomes, test each
+* digit's bit against a per-position mask and turn the result into '0' or
+* '1'. 16 bytes give 128 digits: 8 stores of 16 or 4 of 32. The kernel is
+* store-bound, and 64-byte vectors are no faster than AVX2.
+*/
+typedef void (*bin_kernel)(char *dest, const byte *src, size_t nwords,
+			   size_t word_size);
+
+static void bin_encode_scalar(char *dest, const byte *src, size_t nwords,
+			      size_t word_size)
+{
+	for (size_t word_idx = 0; word_idx < nwords; ++word_idx) {
+		dest = encode_bin_word(dest, src, word_size);
+		src += word_size;
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+
+#define BIT_POSITIONS 0x0102040810204080ull	// 0x80 >> idx in byte idx
+
+__attribute__((target("ssse3")))
+static inline void bin_store_16(char *dest, __m128i bytes)
+{
+	const __m128i bits = _mm_set1_epi64x(BIT_POSITIONS);
+	const __m128i zeros = _mm_set1_epi8('0');
+	const __m128i step = _mm_set1_epi8(2);
+	__m128i index = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0,
+				      1, 1, 1, 1, 1, 1, 1, 1);
+
+	for (size_t idx = 0; idx < 8; ++idx) {
+		__m128i spread = _mm_shuffle_epi8(bytes, index);
+		__m128i set = _mm_cmpeq_epi8(_mm_and_si128(spread, bits), bits);
+		_mm_storeu_si128((__m128i *)(dest + 16 * idx),
+				 _mm_sub_epi8(zeros, set));
+		index = _mm_add_epi8(index, step);
+	}
+}
+
+__attribute__((target("avx2")))
+static inline void bin_store_32(char *dest, __m128i bytes)
+{
+	const __m256i bits = _mm256_set1_epi64x(BIT_POSITIONS);
+	const __m256i zeros = _mm256_set1_epi8('0');
+	const __m256i step = _mm256_set1_epi8(4);
+	const __m256i lanes = _mm256_broadcastsi128_si256(bytes);
+	__m256i index = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0,
+					 1, 1, 1, 1, 1, 1, 1, 1,
+					 2, 2, 2, 2, 2, 2, 2, 2,
+					 3, 3, 3, 3, 3, 3, 3, 3);
+
+	for (size_t idx = 0; idx < 4; ++idx) {
+		__m256i spread = _mm256_shuffle_epi8(lanes, index);
+		__m256i set = _mm256_cmpeq_epi8(_mm256_and_si256(spread, bits),
+						bits);
+		_mm256_storeu_si256((__m256i *)(dest + 32 * idx),
+				    _mm256_sub_epi8(zeros, set));
+		index = _mm256_add_epi8(index, step);
+	}
+}
+
+/*
+* Load the 16 bytes below <src> + <len>, most significant first
+*/
+__attribute__((target("ssse3")))
+static inline __m128i load_reversed_16(const byte *src, size_t len)
+{
+	const __m128i mask = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+					   7, 6, 5, 4, 3, 2, 1, 0);
+	return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)
+						(src + len - 16)), mask);
+}
+
+/*
+* The kernels below differ only in the store; each walks wide words 16 bytes
+* at a time from the most significant end, and packs 16 / <word_size> words
+* of a power-of-two size below 16 into every vector
+*/
+
+__attribute__((target("ssse3")))
+static void bin_encode_ssse3(char *dest, const byte *src, size_t nwords,
+			     size_t word_size)
+{
+	if (word_size >= 16 || !is_power_of_two(word_size)) {
+		for (size_t word_idx = 0; word_idx < nwords; ++word_idx) {
+			size_t len = word_size;
+			for (; len >= 16; len -= 16) {
+				bin_store_16(dest, load_reversed_16(src, len));
+				dest += 128;
+			}
+			dest = encode_bin_word(dest, src, len);
+			src += word_size;
+		}
+		return;
+	}
+
+	byte mask_bytes[16];
+	reverse_mask(mask_bytes, word_size);
+	const __m128i mask = _mm_loadu_si128((const __m128i *)mask_bytes);
+
+	const size_t words_per_vector = 16 / word_size;
+	for (; nwords >= words_per_vector; nwords -= words_per_vector) {
+		__m128i bytes = _mm_loadu_si128((const __m128i *)src);
+		bin_store_16(dest, _mm_shuffle_epi8(bytes, mask));
+		dest += 128;
+		src += 16;
+	}
+	bin_encode_scalar(dest, src, nwords, word_size);
+}
+
+__attribute__((target("avx2")))
+static void bin_encode_avx2(char *dest, const byte *src, size_t nwords,
+			    size_t word_size)
+{
+	if (word_size >= 16 || !is_power_of_two(word_size)) {
+		for (size_t word_idx = 0; word_idx < nwords; ++word_idx) {
+			size_t len = word_size;
+			for (; len >= 16; len -= 16) {
+				bin_store_32(dest, load_reversed_16(src, len));
+				dest += 128;
+			}
+			dest = encode_bin_word(dest, src, len);
+			src += word_size;
+		}
+		return;
+	}
+
+	byte mask_bytes[16];
+	reverse_mask(mask_bytes, word_size);
+	const __m128i mask = _mm_loadu_si128((const __m128i *)mask_bytes);
+
+	const size_t words_per_vector = 16 / word_size;
+	for (; nwords >= words_per_vector; nwords -= words_per_vector) {
+		__m128i bytes = _mm_loadu_si128((const __m128i *)src);
+		bin_store_32(dest, _mm_shuffle_epi8(bytes, mask));
+		dest += 128;
+		src += 16;
+	}
+	bin_encode_scalar(dest, src, nwords, word_size);
+}
+
+#endif				// HAVE_X86_SIMD
+
+static bin_kernel select_bin_kernel(void)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return bin_encode_avx2;
+	}
+	if (__builtin_cpu_supports("ssse3")) {
+		return bin_encode_ssse3;
+	}
+#endif
+	return bin_encode_scalar;
+}
+
+//////////////////////////////// Hex decoding /////////////////////////////////
+
+/*
+* A hex decoder reads 2 * <word_size> digits, most significant first, into a
+* little-endian word. Return false on a character that is not a hex digit.
+*/
+typedef bool (*hex_decoder)(byte *word, const char *digits, size_t word_size);
+
+static bool hex_decode_scalar(byte *word, const char *digits, size_t word_size)
+{
+	for (size_t byte_idx = word_size; byte_idx > 0; --byte_idx) {
+		signed char high = DIGIT_VALUE_TABLE[(byte)digits[0]];
+		signed char low = DIGIT_VALUE_TABLE[(byte)digits[1]];
+		if ((byte)(high | low) > 15) {	// not a hex digit, or -1
+			return false;
+		}
+		word[byte_idx - 1] = (high << 4) | low;
+		digits += 2;
+	}
+	return true;
+}
+
+#ifdef HAVE_X86_SIMD
+
+/*
+* 16 digits at a time: map both digit ranges to nibbles, check that every
+* character was in one of them, merge nibble pairs with a multiply-add and
+* store the 8 bytes reversed
+*/
+__attribute__((target("ssse3")))
+static bool hex_decode_ssse3(byte *word, const char *digits, size_t word_size)
+{
+	const __m128i reverse = _mm_set_epi8(-1, -1, -1, -1, -1, -1, -1, -1,
+					     0, 1, 2, 3, 4, 5, 6, 7);
+	const __m128i nibble_weights = _mm_set1_epi16(0x0110);
+
+	byte *dest = word + word_size;
+	for (; dest - word >= 8; digits += 16) {
+		__m128i chars = _mm_loadu_si128((const __m128i *)digits);
+
+		__m128i decimal = _mm_sub_epi8(chars, _mm_set1_epi8('0'));
+		__m128i is_decimal =
+		    _mm_and_si128(_mm_cmpgt_epi8(decimal, _mm_set1_epi8(-1)),
+				  _mm_cmplt_epi8(decimal, _mm_set1_epi8(10)));
+		__m128i letter = _mm_sub_epi8(_mm_or_si128(chars,
+							   _mm_set1_epi8(0x20)),
+					      _mm_set1_epi8('a'));
+		__m128i is_letter =
+		    _mm_and_si128(_mm_cmpgt_epi8(letter, _mm_set1_epi8(-1)),
+				  _mm_cmplt_epi8(letter, _mm_set1_epi8(6)));
+		if (_mm_movemask_epi8(_mm_or_si128(is_decimal, is_letter))
+		    != 0xffff) {
+			return false;
+		}
+
+		__m128i nibbles =
+		    _mm_or_si128(_mm_and_si128(is_decimal, decimal),
+				 _mm_and_si128(is_letter,
+					       _mm_add_epi8(letter,
+							    _mm_set1_epi8(10))));
+		__m128i pairs = _mm_maddubs_epi16(nibbles, nibble_weights);
+		__m128i bytes = _mm_packus_epi16(pairs, pairs);
+
+		dest -= 8;
+		_mm_storel_epi64((__m128i *)dest,
+				 _mm_shuffle_epi8(bytes, reverse));
+	}
+	return hex_decode_scalar(word, digits, dest - word);
+}
+
+#endif				// HAVE_X86_SIMD
+
+static hex_decoder select_hex_decoder(void)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("ssse3")) {
+		return hex_decode_ssse3;
+	}
+#endif
+	return hex_decode_scalar;
+}
+
+//////////////////////////////// Bit unpacking ////////////////////////////////
+
+/*
+* Widths that are not a multiple of 8 come bit-packed: word i occupies bits
+* [i * width, (i + 1) * width) of the input, least significant bit first.
+* Every 8 words end on a byte boundary. An unpacker spreads <nwords> packed
+* words, starting at bit 0 of <src>, into words of ceil(width / 8) bytes with
+* the unused high bits clear. It reads no byte past the last word.
+*/
+typedef void (*bit_unpacker)(byte *dest, const byte *src, size_t nwords,
+			     unsigned int width);
+
+/*
+* Load up to 8 little-endian bytes; fewer when only <avail> are left
+*/
+static inline uint64_t load_le64(const byte *src, size_t avail)
+{
+	uint64_t value = 0;
+	if (avail >= 8) {
+		memcpy(&value, src, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		value = __builtin_bswap64(value);
+#endif
+		return value;
+	}
+	for (size_t idx = 0; idx < avail; ++idx) {
+		value |= (uint64_t)src[idx] << (8 * idx);
+	}
+	return value;
+}
+
+/*
+* One 64-bit load, shift and mask per 7 bytes of output: a 56-bit field at any
+* bit offset fits into the 8 bytes loaded from its first byte
+*/
+static void unpack_words(byte *dest, const byte *src, size_t first,
+			 size_t nwords, unsigned int width)
+{
+	const size_t word_size = ((size_t)width + 7) / 8;
+	const size_t src_len = ((first + nwords) * width + 7) / 8;
+
+	for (size_t word_idx = first; word_idx < first + nwords; ++word_idx) {
+		size_t bit = word_idx * width;
+		for (size_t out = 0; out < word_size; out += 7) {
+			size_t field = width - 8 * out;
+			if (field > 56) {
+				field = 56;
+			}
+
+			uint64_t value = load_le64(src + bit / 8,
+						   src_len - bit / 8);
+			value = (value >> (bit % 8)) & ((1ull << field) - 1);
+			for (size_t idx = out; idx < word_size && idx < out + 7;
+			     ++idx) {
+				dest[idx] = value;
+				value >>= 8;
+			}
+			bit += 56;
+		}
+		dest += word_size;
+	}
+}
+
+static void unpack_bits_scalar(byte *dest, const byte *src, size_t nwords,
+			       unsigned int width)
+{
+	unpack_words(dest, src, 0, nwords, width);
+}
+
+#ifdef HAVE_X86_SIMD
+
+/*
+* Narrow words with one pdep per 64 bits of output: 8 one-byte words, 4
+* two-byte words or 2 four-byte words at once. Words of up to 56 bits take one
+* load and bzhi each; wider words go through the scalar loop.
+*/
+__attribute__((target("bmi2")))
+static void unpack_bits_bmi2(byte *dest, const byte *src, size_t nwords,
+			     unsigned int width)
+{
+	const size_t src_len = (nwords * width + 7) / 8;
+	size_t word_idx = 0;
+
+	if (width < 8) {
+		const uint64_t mask = ((1ull << width) - 1)
+		    * 0x0101010101010101ull;
+		// 8 words are <width> whole bytes
+		for (; word_idx + 8 <= nwords && (word_idx / 8) * width + 8
+		     <= src_len; word_idx += 8) {
+			uint64_t bits = load_le64(src + (word_idx / 8) * width, 8);
+			uint64_t words = _pdep_u64(bits, mask);
+			memcpy(dest, &words, 8);
+			dest += 8;
+		}
+	} else if (width < 16) {
+		const uint64_t mask = ((1ull << width) - 1)
+		    * 0x0001000100010001ull;
+		for (; word_idx + 4 <= nwords && (word_idx * width) / 8 + 8
+		     <= src_len; word_idx += 4) {
+			size_t bit = word_idx * width;
+			uint64_t bits = load_le64(src + bit / 8, 8) >> (bit % 8);
+			uint64_t words = _pdep_u64(bits, mask);
+			memcpy(dest, &words, 8);
+			dest += 8;
+		}
+	} else if (width <= 28) {
+		// Two words and the bit offset fit into one load
+		const uint64_t mask = ((1ull << width) - 1)
+		    * 0x0000000100000001ull;
+		const byte word_size = (width + 7) / 8;
+		for (; word_idx + 2 <= nwords && (word_idx * width) / 8 + 8
+		     <= src_len; word_idx += 2) {
+			size_t bit = word_idx * width;
+			uint64_t bits = load_le64(src + bit / 8, 8) >> (bit % 8);
+			uint64_t words = _pdep_u64(bits, mask);
+			memcpy(dest, &words, word_size);
+			memcpy(dest + word_size, (byte *)&words + 4, word_size);
+			dest += 2 * word_size;
+		}
+	} else if (width <= 56) {
+		const byte word_size = (width + 7) / 8;
+		for (; word_idx < nwords && (word_idx * width) / 8 + 8
+		     <= src_len; ++word_idx) {
+			size_t bit = word_idx * width;
+			uint64_t word = _bzhi_u64(load_le64(src + bit / 8, 8)
+						  >> (bit % 8), width);
+			memcpy(dest, &word, word_size);
+			dest += word_size;
+		}
+	}
+
+	unpack_words(dest, src, word_idx, nwords - word_idx, width);
+}
+
+#endif				// HAVE_X86_SIMD
+
+static bit_unpacker select_bit_unpacker(void)
+{
+#if defined(HAVE_X86_SIMD) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("bmi2")) {
+		return unpack_bits_bmi2;
+	}
+#endif
+	return unpack_bits_scalar;
+}
+
+////////////////////////////////// Byte order /////////////////////////////////
+
+/*
+* Words in another byte order are brought to little-endian before they are
+* encoded. Every order is a sequence of <group>-byte groups, most significant
+* group first and each group little-endian: 1 byte for big-endian, 4 or 2 for
+* swapped words or half-words. A swapper reverses the groups of <nwords> words
+* of <word_size> bytes, a multiple of <group>. The reversal is its own inverse;
+* <dest> may be <src>.
+*/
+typedef void (*byte_swapper)(byte *dest, const byte *src, size_t nwords,
+			     size_t word_size, size_t group);
+
+/*
+* Swap groups from both ends inwards, so the word may be reversed in place
+*/
+static inline void swap_groups(byte *dest, const byte *src, size_t word_size,
+			       size_t group)
+{
+	size_t low = 0;
+	size_t high = word_size - group;
+	for (; low < high; low += group, high -= group) {
+		uint32_t lhs = 0;
+		uint32_t rhs = 0;
+		memcpy(&lhs, src + low, group);
+		memcpy(&rhs, src + high, group);
+		memcpy(dest + low, &rhs, group);
+		memcpy(dest + high, &lhs, group);
+	}
+	if (low == high && dest != src) {
+		memcpy(dest + low, src + low, group);
+	}
+}
+
+static void swap_bytes_scalar(byte *dest, const byte *src, size_t nwords,
+			      size_t word_size, size_t group)
+{
+	// One copy of the loop per group size, with the copies folded
+	for (; nwords > 0; --nwords) {
+		switch (group) {
+		case 1:
+			swap_groups(dest, src, word_size, 1);
+			break;
+		case 2:
+			swap_groups(dest, src, word_size, 2);
+			break;
+		default:
+			swap_groups(dest, src, word_size, 4);
+			break;
+		}
+		dest += word_size;
+		src += word_size;
+	}
+}
+
+/*
+* Fill a 16-byte shuffle mask reversing the <group>-byte groups of every
+* <word_size>-byte word of a lane (of the whole lane when <word_size> is 16 or
+* more)
+*/
+static void swap_mask(byte mask[16], size_t word_size, size_t group)
+{
+	if (word_size > 16) {
+		word_size = 16;
+	}
+	for (byte idx = 0; idx < 16; ++idx) {
+		size_t pos = idx % word_size;
+		mask[idx] = idx - pos + word_size - group - pos / group * group
+		    + pos % group;
+	}
+}
+
+#ifdef HAVE_X86_SIMD
+
+/*
+* Words of a multiple of 16 bytes: the lanes from both ends are loaded before
+* either is stored, reversed in order and shuffled within
+*/
+__attribute__((target("ssse3")))
+static inline void swap_lanes_16(byte *dest, const byte *src, size_t word_size,
+				 __m128i mask)
+{
+	for (size_t low = 0; 2 * low < word_size; low += 16) {
+		size_t high = word_size - 16 - low;
+		__m128i lhs = _mm_loadu_si128((const __m128i *)(src + low));
+		__m128i rhs = _mm_loadu_si128((const __m128i *)(src + high));
+		_mm_storeu_si128((__m128i *)(dest + low),
+				 _mm_shuffle_epi8(rhs, mask));
+		_mm_storeu_si128((__m128i *)(dest + high),
+				 _mm_shuffle_epi8(lhs, mask));
+	}
+}
+
+__attribute__((target("ssse3")))
+static void swap_bytes_ssse3(byte *dest, const byte *src, size_t nwords,
+			     size_t word_size, size_t group)
+{
+	byte mask_bytes[16];
+	swap_mask(mask_bytes, word_size, group);
+	const __m128i mask = _mm_loadu_si128((const __m128i *)mask_bytes);
+
+	if (word_size % 16 == 0) {
+		for (; nwords > 0; --nwords) {
+			swap_lanes_16(dest, src, word_size, mask);
+			dest += word_size;
+			src += word_size;
+		}
+		return;
+	}
+	if (!is_power_of_two(word_size)) {
+		swap_bytes_scalar(dest, src, nwords, word_size, group);
+		return;
+	}
+
+	const size_t words_per_vector = 16 / word_size;
+	for (; nwords >= words_per_vector; nwords -= words_per_vector) {
+		__m128i bytes = _mm_loadu_si128((const __m128i *)src);
+		_mm_storeu_si128((__m128i *)dest, _mm_shuffle_epi8(bytes, mask));
+		dest += 16;
+		src += 16;
+	}
+	swap_bytes_scalar(dest, src, nwords, word_size, group);
+}
+
+__attribute__((target("avx2")))
+static void swap_bytes_avx2(byte *dest, const byte *src, size_t nwords,
+			    size_t word_size, size_t group)
+{
+	byte mask_bytes[16];
+	swap_mask(mask_bytes, word_size, group);
+	const __m128i lane_mask = _mm_loadu_si128((const __m128i *)mask_bytes);
+	const __m256i mask = _mm256_broadcastsi128_si256(lane_mask);
+
+	if (word_size % 32 == 0) {
+		// Both lanes of a vector trade places, too
+		for (; nwords > 0; --nwords) {
+			for (size_t low = 0; 2 * low < word_size; low += 32) {
+				size_t high = word_size - 32 - low;
+				__m256i lhs = _mm256_loadu_si256((const __m256i *)
+								 (src + low));
+				__m256i rhs = _mm256_loadu_si256((const __m256i *)
+								 (src + high));
+				lhs = _mm256_permute4x64_epi64
+				    (_mm256_shuffle_epi8(lhs, mask), 0x4e);
+				rhs = _mm256_permute4x64_epi64
+				    (_mm256_shuffle_epi8(rhs, mask), 0x4e);
+				_mm256_storeu_si256((__m256i *)(dest + low), rhs);
+				_mm256_storeu_si256((__m256i *)(dest + high), lhs);
+			}
+			dest += word_size;
+			src += word_size;
+		}
+		return;
+	}
+	if (word_size % 16 == 0 && word_size > 16) {
+		for (; nwords > 0; --nwords) {
+			swap_lanes_16(dest, src, word_size, lane_mask);
+			dest += word_size;
+			src += word_size;
+		}
+		return;
+	}
+	if (!is_power_of_two(word_size)) {
+		swap_bytes_scalar(dest, src, nwords, word_size, group);
+		return;
+	}
+
+	const size_t words_per_vector = 32 / word_size;
+	for (; nwords >= words_per_vector; nwords -= words_per_vector) {
+		__m256i bytes = _mm256_loadu_si256((const __m256i *)src);
+		_mm256_storeu_si256((__m256i *)dest,
+				    _mm256_shuffle_epi8(bytes, mask));
+		dest += 32;
+		src += 32;
+	}
+	swap_bytes_ssse3(dest, src, nwords, word_size, group);
+}
+
+#endif				// HAVE_X86_SIMD
+
+static byte_swapper select_byte_swapper(void)
+{
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		return swap_bytes_avx2;
+	}
+	if (__builtin_cpu_supports("ssse3")) {
+		return swap_bytes_ssse3;
+	}
+#endif
+	return swap_bytes_scalar;
+}
+
+/*
+* Bytes per group of <order> for words of <width> bits: 0 when the words need
+* no swapping, or -1 if the order does not apply to the width
+*/
+static long swap_group(unsigned int width, enum mif_byte_order order)
+{
+	static const long GROUPS[] = { 0, 1, 4, 2 };	// by enum mif_byte_order
+
+	if ((unsigned int)order > MIF_ORDER_HALF_WORD_SWAPPED) {
+		return -1;
+	}
+	const long group = GROUPS[order];
+	const size_t word_size = ((size_t)width + 7) / 8;
+	if (group == 0) {
+		return 0;
+	}
+	if (width % 8 != 0 || word_size % group != 0) {
+		return -1;
+	}
+	return (word_size > (size_t)group ? group : 0);
+}
+
+////////////////////////////////// Utilities //////////////////////////////////
+
+static unsigned int num_len(unsigned long long num, byte base)
+{
+	unsigned int len = 1;
+	num /= base;
+	while (num > 0) {
+		num /= base;
+		++len;
+	}
+	return len;
+}
+
+/*
+* Allocate <size> bytes aligned to BUFFER_ALIGNMENT; release with free
+*/
+static void *alloc_aligned(size_t size)
+{
+	void *ptr = NULL;
+	int error = posix_memalign(&ptr, BUFFER_ALIGNMENT, size);
+	if (error != 0) {
+		errno = error;
+		return NULL;
+	}
+	return ptr;
+}
+
+static inline size_t align_up(size_t size)
+{
+	return (size + BUFFER_ALIGNMENT - 1) / BUFFER_ALIGNMENT
+	    * BUFFER_ALIGNMENT;
+}
+
+/*
+* Write <value> as exactly <len> zero-padded lowercase digits in <base>
+*/
+static inline void format_number(char *dest, unsigned int len,
+				 unsigned long long value, byte base)
+{
+	for (unsigned int idx = len; idx > 0; --idx) {
+		dest[idx - 1] = HEX_DIGITS[value % base];
+		value /= base;
+	}
+}
+
+/*
+* Increment a zero-padded lowercase number in <base> in place, propagating the
+* carry only as far as needed
+*/
+static inline void increment_number(char *digits, unsigned int len, byte base)
+{
+	const char last = HEX_DIGITS[base - 1];
+	for (char *digit = digits + len - 1; digit >= digits; --digit) {
+		if (*digit == last) {
+			*digit = '0';
+			continue;
+		}
+		*digit = (*digit == '9' ? 'a' : *digit + 1);
+		return;
+	}
+}
+
+struct radix {
+	const char *name;
+	byte base;
+	bool is_signed;
+};
+
+// In enum mif_radix order
+static const struct radix RADICES[] = {
+	{"BIN", 2, false},
+	{"OCT", 8, false},
+	{"DEC", 10, true},
+	{"UNS", 10, false},
+	{"HEX", 16, false},
+	{NULL, 0, false}
+};
+
+/*
+* Number of decimal digits of 2^<bits> - 1: floor(bits * log10(2)) + 1, with
+* log10(2) as a 96-bit fixed-point fraction
+*/
+static inline size_t decimal_digits(unsigned int bits)
+{
+	const unsigned __int128 log10_2 =
+	    (unsigned __int128)0x4d104d42 << 64 | 0x7de7fbcc47c4acd6;
+	return (size_t)((bits * log10_2) >> 96) + 1;
+}
+
+/*
+* Number of digits of a <width>-bit data value in <radix>, enough for any
+* value; DEC has a sign position in front of the digits of 2^(width - 1)
+*/
+static size_t data_field_len(unsigned int width, const struct radix *radix)
+{
+	switch (radix->base) {
+	case 2:
+		return width;
+	case 8:
+		return ((size_t)width + 2) / 3;
+	case 10:
+		return radix->is_signed ? decimal_digits(width - 1) + 1
+		    : decimal_digits(width);
+	default:
+		return ((size_t)width + 3) / 4;
+	}
+}
+
+////////////////////////////////// Records ////////////////////////////////////
+
+/*
+* Every record has the same layout: "<address> : <data> <data> ...;\n" with
+* words_per_line values (fewer only in the last record), so its length is
+* fixed for a given depth, width and pair of radices: the address is
+* zero-padded to the digits of depth - 1 and the data to the digits of the
+* widest value. HEX data comes from the kernel with an even number of digits;
+* when the field is odd, the leading (always zero) digit is skipped.
+*/
+struct record_format;
+
+typedef void (*data_encoder)(const struct record_format *fmt, char *dest,
+			     const byte *words, size_t nwords);
+
+struct record_format {
+	unsigned int width;
+	size_t word_size;
+	byte addr_base;
+	unsigned int addr_repr_width;
+	size_t data_offset;
+	size_t data_len;
+	size_t data_stride;	// digits written per word by encode_data
+	size_t words_per_line;
+	size_t record_len;	// of a full record
+	bool data_signed;
+	data_encoder encode_data;
+	hex_kernel encode_hex;
+	bin_kernel encode_bin;
+};
+
+static void encode_data_hex(const struct record_format *fmt, char *dest,
+			    const byte *words, size_t nwords)
+{
+	fmt->encode_hex(dest, words, nwords, fmt->word_size);
+}
+
+/*
+* BIN: whole bytes go through the kernel; bit-packed widths take 8 digits per
+* byte from the table, with only the used bits of the top byte
+*/
+static void encode_data_bin(const struct record_format *fmt, char *dest,
+			    const byte *words, size_t nwords)
+{
+	const size_t word_size = fmt->word_size;
+	const size_t top_bits = (fmt->width - 1) % 8 + 1;
+
+	if (top_bits == 8) {
+		fmt->encode_bin(dest, words, nwords, word_size);
+		return;
+	}
+
+	for (; nwords > 0; --nwords) {
+		memcpy(dest, BIN_BYTE_TABLE[words[word_size - 1]] + 8 - top_bits,
+		       top_bits);
+		(void)encode_bin_word(dest + top_bits, words, word_size - 1);
+		dest += fmt->data_len;
+		words += word_size;
+	}
+}
+
+/*
+* OCT: 4 digits per 12 bits from the table, filled in from the least
+* significant end
+*/
+static void encode_data_oct(const struct record_format *fmt, char *dest,
+			    const byte *words, size_t nwords)
+{
+	const size_t word_size = fmt->word_size;
+
+	for (; nwords > 0; --nwords) {
+		char *digit = dest + fmt->data_len;
+		for (size_t bit = 0; bit < fmt->width; bit += 12) {
+			size_t ndigits = (fmt->width - bit >= 12
+					  ? 4 : (fmt->width - bit + 2) / 3);
+			unsigned int group =
+			    (load_le64(words + bit / 8, word_size - bit / 8)
+			     >> (bit % 8)) & 0xfff;
+			digit -= ndigits;
+			memcpy(digit, OCT_GROUP_TABLE[group] + 4 - ndigits,
+			       ndigits);
+		}
+		dest += fmt->data_len;
+		words += word_size;
+	}
+}
+
+/*
+* Write <value>, below 10^8, as 8 digits: two halves of 4, then two pairs
+* each from the table
+*/
+static inline void format_decimal8(char *dest, uint32_t value)
+{
+	uint32_t high = value / 10000;
+	uint32_t low = value % 10000;
+
+	memcpy(dest, DEC_PAIR_TABLE[high / 100], 2);
+	memcpy(dest + 2, DEC_PAIR_TABLE[high % 100], 2);
+	memcpy(dest + 4, DEC_PAIR_TABLE[low / 100], 2);
+	memcpy(dest + 6, DEC_PAIR_TABLE[low % 100], 2);
+}
+
+/*
+* Copy the last digits of <digits> (<len> of them, right-aligned) into the
+* field at <dest>, zero-padding in front, with a '-' or a '0' first for DEC
+*/
+static inline void fill_decimal_field(const struct record_format *fmt,
+				      char *dest, const char *digits,
+				      size_t len, bool negative)
+{
+	const size_t sign_len = fmt->data_signed;
+	const size_t ndigits = fmt->data_len - sign_len;
+
+	if (len > ndigits) {
+		digits += len - ndigits;	// leading zeros
+		len = ndigits;
+	}
+	memset(dest, '0', fmt->data_len - len);
+	memcpy(dest + fmt->data_len - len, digits, len);
+	if (negative) {
+		dest[0] = '-';
+	}
+}
+
+/*
+* DEC and UNS of up to 64 bits: the magnitude is split into 8-digit chunks
+* and a 4-digit top, only as many as the width needs (2^26 < 10^8,
+* 2^53 < 10^16). The divisions by constant powers of ten compile to
+* multiply-high reciprocals.
+*/
+static void encode_data_dec64(const struct record_format *fmt, char *dest,
+			      const byte *words, size_t nwords)
+{
+	const size_t word_size = fmt->word_size;
+	const unsigned int width = fmt->width;
+	const uint64_t mask = (width < 64
+			       ? ((uint64_t)1 << width) - 1 : UINT64_MAX);
+	const uint64_t sign = (fmt->data_signed
+			       ? (uint64_t)1 << (width - 1) : 0);
+	const size_t sign_len = fmt->data_signed;
+	const size_t ndigits = fmt->data_len - sign_len;
+	char digits[20];
+	char *const last8 = digits + sizeof(digits) - 8;
+
+	for (; nwords > 0; --nwords) {
+		uint64_t value = load_le64(words, word_size) & mask;
+		bool negative = (value & sign) != 0;
+		value = (negative ? -value & mask : value);	// magnitude
+
+		if (width <= 26) {
+			format_decimal8(last8, value);
+		} else {
+			uint64_t low = value % 10000000000000000;
+			format_decimal8(last8 - 8, low / 100000000);
+			format_decimal8(last8, low % 100000000);
+			if (width > 53) {
+				uint32_t high = value / 10000000000000000;
+				memcpy(digits, DEC_PAIR_TABLE[high / 100], 2);
+				memcpy(digits + 2, DEC_PAIR_TABLE[high % 100],
+				       2);
+			}
+		}
+
+		// Enough digits were written to need no padding
+		memcpy(dest + sign_len, digits + sizeof(digits) - ndigits,
+		       ndigits);
+		if (sign_len > 0) {
+			dest[0] = (negative ? '-' : '0');
+		}
+
+		dest += fmt->data_len;
+		words += word_size;
+	}
+}
+
+/*
+* Wider DEC and UNS: the magnitude, in 32-bit limbs, is divided by 10^8 per
+* pass for 8 digits at a time, from the least significant end
+*/
+static void encode_data_dec(const struct record_format *fmt, char *dest,
+			    const byte *words, size_t nwords)
+{
+	const size_t word_size = fmt->word_size;
+	const size_t nlimbs = (fmt->width + 31) / 32;
+	const unsigned int sign_bit = fmt->width - 1;
+	uint32_t limbs[MIF_MAX_DECIMAL_WIDTH / 32];
+	char digits[(MIF_MAX_DECIMAL_WIDTH / 26 + 1) * 8];	// 2^26 < 10^8
+
+	for (; nwords > 0; --nwords) {
+		memset(limbs, 0, nlimbs * sizeof(uint32_t));
+		for (size_t idx = 0; idx < word_size; ++idx) {
+			limbs[idx / 4] |= (uint32_t)words[idx] << (8 * (idx % 4));
+		}
+
+		// Two's complement negation within the width
+		bool negative = fmt->data_signed
+		    && (words[sign_bit / 8] >> (sign_bit % 8) & 1);
+		if (negative) {
+			uint64_t carry = 1;
+			for (size_t idx = 0; idx < nlimbs; ++idx) {
+				carry += (uint32_t)~limbs[idx];
+				limbs[idx] = (uint32_t)carry;
+				carry >>= 32;
+			}
+			if (fmt->width % 32 != 0) {
+				limbs[nlimbs - 1] &= (1u << (fmt->width % 32)) - 1;
+			}
+		}
+
+		char *chunk = digits + sizeof(digits);
+		size_t top = nlimbs;
+		while (top > 0 && limbs[top - 1] == 0) {
+			--top;
+		}
+		while (top > 0) {
+			uint64_t rem = 0;
+			for (size_t idx = top; idx > 0; --idx) {
+				uint64_t cur = rem << 32 | limbs[idx - 1];
+				limbs[idx - 1] = cur / 100000000;
+				rem = cur % 100000000;
+			}
+			while (top > 0 && limbs[top - 1] == 0) {
+				--top;
+			}
+
+			chunk -= 8;
+			format_decimal8(chunk, rem);
+		}
+		fill_decimal_field(fmt, dest, chunk,
+				   digits + sizeof(digits) - chunk, negative);
+
+		dest += fmt->data_len;
+		words += word_size;
+	}
+}
+
+static void record_format_init(struct record_format *fmt,
+			       const struct mif_config *config,
+			       hex_kernel encode_hex, bin_kernel encode_bin)
+{
+	const unsigned int width = config->width;
+	const struct radix *data = &RADICES[config->data_radix];
+
+	fmt->width = width;
+	fmt->word_size = ((size_t)width + 7) / 8;
+	fmt->addr_base = RADICES[config->address_radix].base;
+	fmt->addr_repr_width = num_len(config->depth - 1, fmt->addr_base);
+	fmt->data_offset = fmt->addr_repr_width + 3;
+	fmt->data_len = data_field_len(width, data);
+	fmt->data_stride = fmt->data_len;
+	fmt->words_per_line = config->words_per_line;
+	fmt->record_len = fmt->data_offset
+	    + fmt->words_per_line * (fmt->data_len + 1) + 1;
+	fmt->data_signed = data->is_signed;
+	fmt->encode_hex = encode_hex;
+	fmt->encode_bin = encode_bin;
+
+	switch (data->base) {
+	case 2:
+		fmt->encode_data = encode_data_bin;
+		break;
+	case 8:
+		fmt->encode_data = encode_data_oct;
+		break;
+	case 10:
+		fmt->encode_data = (width <= 64
+				    ? encode_data_dec64 : encode_data_dec);
+		break;
+	default:
+		fmt->encode_data = encode_data_hex;
+		fmt->data_stride = 2 * fmt->word_size;
+		break;
+	}
+}
+
+/*
+* Advance the address in <addr_template> by one; HEX gets its own copy of the
+* increment with the base folded in
+*/
+static inline void next_address(const struct record_format *fmt,
+				char *addr_template)
+{
+	if (fmt->addr_base == 16) {
+		increment_number(addr_template, fmt->addr_repr_width, 16);
+	} else {
+		increment_number(addr_template, fmt->addr_repr_width,
+				 fmt->addr_base);
+	}
+}
+
+/*
+* Fill <addr_template> (data_offset bytes) with the address part of the record
+* for <addr>
+*/
+static void record_address_init(const struct record_format *fmt,
+				char *addr_template, unsigned long long addr)
+{
+	format_number(addr_template, fmt->addr_repr_width, addr, fmt->addr_base);
+	memcpy(addr_template + fmt->addr_repr_width, " : ", 3);
+}
+
+/*
+* Length of the records of <nwords> words from the start of a record
+*/
+static inline size_t records_len(const struct record_format *fmt,
+				 size_t nwords)
+{
+	size_t last = nwords % fmt->words_per_line;
+	return nwords / fmt->words_per_line * fmt->record_len
+	    + (last > 0 ? fmt->data_offset + last * (fmt->data_len + 1) + 1 : 0);
+}
+
+/*
+* Write the records of <nwords> words to <dest>, which has room for
+* records_len bytes; the first word starts a record. Every value is preceded
+* by the address template, stamped in and advanced in place, or by a space.
+* Short data is encoded a block at a time; long data is encoded straight into
+* its record, before the prefix overwrites a skipped leading digit.
+*/
+static void format_records(const struct record_format *fmt, char *dest,
+			   const byte *words, size_t nwords,
+			   char *addr_template)
+{
+	const size_t word_size = fmt->word_size;
+	const size_t data_len = fmt->data_len;
+	const size_t data_stride = fmt->data_stride;
+	const size_t data_skip = data_stride - data_len;
+	const size_t words_per_line = fmt->words_per_line;
+	size_t column = 0;
+
+	if (data_stride > WIDE_DATA_LEN) {
+		for (; nwords > 0; --nwords) {
+			size_t prefix_len = (column == 0 ? fmt->data_offset : 1);
+			fmt->encode_data(fmt, dest + prefix_len - data_skip,
+					 words, 1);
+			if (column == 0) {
+				memcpy(dest, addr_template, prefix_len);
+			} else {
+				*dest = ' ';
+			}
+			dest += prefix_len + data_len;
+			if (++column == words_per_line || nwords == 1) {
+				memcpy(dest, ";\n", 2);
+				dest += 2;
+				column = 0;
+				for (size_t idx = 0; idx < words_per_line; ++idx) {
+					next_address(fmt, addr_template);
+				}
+			}
+			words += word_size;
+		}
+		return;
+	}
+
+	char digits[FORMAT_BLOCK_SIZE * WIDE_DATA_LEN];
+	while (nwords > 0) {
+		size_t block = (nwords < FORMAT_BLOCK_SIZE
+				? nwords : FORMAT_BLOCK_SIZE);
+		fmt->encode_data(fmt, digits, words, block);
+
+		for (size_t word_idx = 0; word_idx < block && words_per_line == 1;
+		     ++word_idx) {
+			memcpy(dest, addr_template, fmt->data_offset);
+			memcpy(dest + fmt->data_offset,
+			       digits + word_idx * data_stride + data_skip,
+			       data_len);
+			memcpy(dest + fmt->record_len - 2, ";\n", 2);
+			next_address(fmt, addr_template);
+			dest += fmt->record_len;
+		}
+		for (size_t word_idx = 0; word_idx < block && words_per_line > 1;
+		     ++word_idx) {
+			if (column == 0) {
+				memcpy(dest, addr_template, fmt->data_offset);
+				dest += fmt->data_offset;
+			} else {
+				*dest++ = ' ';
+			}
+			memcpy(dest, digits + word_idx * data_stride + data_skip,
+			       data_len);
+			dest += data_len;
+			if (++column == words_per_line
+			    || word_idx + 1 == nwords) {
+				memcpy(dest, ";\n", 2);
+				dest += 2;
+				column = 0;
+				for (size_t idx = 0; idx < words_per_line; ++idx) {
+					next_address(fmt, addr_template);
+				}
+			}
+		}
+
+		words += block * word_size;
+		nwords -= block;
+	}
+}
+
+//////////////////////////////////// Runs /////////////////////////////////////
+
+/*
+* Return the index of the first byte where <lhs> and <rhs> differ, or <nbytes>
+* if they are equal. Compares 16 bytes per step with SSE2, 8 bytes otherwise.
+*/
+static inline size_t first_mismatch(const byte *lhs, const byte *rhs,
+				    size_t nbytes)
+{
+	size_t idx = 0;
+
+#ifdef __SSE2__
+	for (; idx + 16 <= nbytes; idx += 16) {
+		__m128i left = _mm_loadu_si128((const __m128i *)(lhs + idx));
+		__m128i right = _mm_loadu_si128((const __m128i *)(rhs + idx));
+		unsigned int equal =
+		    _mm_movemask_epi8(_mm_cmpeq_epi8(left, right));
+		if (equal != 0xffff) {
+			return idx + __builtin_ctz(~equal);
+		}
+	}
+#endif
+
+	for (; idx + 8 <= nbytes; idx += 8) {
+		uint64_t left, right;
+		memcpy(&left, lhs + idx, 8);
+		memcpy(&right, rhs + idx, 8);
+		if (left != right) {
+			break;
+		}
+	}
+	for (; idx < nbytes && lhs[idx] == rhs[idx]; ++idx) ;
+
+	return idx;
+}
+
+/*
+* Return how many of the <nwords> words at <words> (at least one) are equal to
+* the first. Comparing the block against itself shifted by one word finds the
+* end of the run in a single linear pass.
+*/
+static inline size_t run_length(const byte *words, size_t nwords,
+				size_t word_size)
+{
+	if (nwords <= 1) {
+		return nwords;
+	}
+
+	size_t nbytes = (nwords - 1) * word_size;
+	return first_mismatch(words + word_size, words, nbytes) / word_size + 1;
+}
+
+/////////////////////////////////// Parser ////////////////////////////////////
+
+/*
+* The .mif grammar: header assignments, records and comments, with numbers
+* in any of the five radices
+*/
+
+static const struct radix *find_radix(const char *name, size_t len)
+{
+	for (const struct radix *radix = RADICES; radix->name != NULL; ++radix) {
+		if (strlen(radix->name) == len
+		    && strncasecmp(radix->name, name, len) == 0) {
+			return radix;
+		}
+	}
+	return NULL;
+}
+
+struct mif_layout {
+	long long depth;
+	unsigned int width;
+	size_t word_size;
+	const struct radix *addr_radix;
+	const struct radix *data_radix;
+
+	const char *content;	// first byte after BEGIN
+	const char *content_end;	// END keyword, or end of text
+};
+
+static inline int digit_value(char chr)
+{
+	return DIGIT_VALUE_TABLE[(byte)chr];
+}
+
+static inline bool is_token_char(char chr)
+{
+	return digit_value(chr) >= 0 || chr == '_';
+}
+
+/*
+* Skip whitespace, "-- line" comments and "% block %" comments
+*/
+static inline const char *skip_blanks(const char *pos, const char *end)
+{
+	while (pos < end) {
+		if (*pos == ' ' || *pos == '\t' || *pos == '\n' || *pos == '\r') {
+			++pos;
+		} else if (*pos == '-' && pos + 1 < end && pos[1] == '-') {
+			pos = memchr(pos, '\n', end - pos);
+			pos = (pos != NULL ? pos + 1 : end);
+		} else if (*pos == '%') {
+			pos = memchr(pos + 1, '%', end - pos - 1);
+			pos = (pos != NULL ? pos + 1 : end);
+		} else {
+			break;
+		}
+	}
+	return pos;
+}
+
+static inline const char *token_end(const char *pos, const char *end)
+{
+	while (pos < end && is_token_char(*pos)) {
+		++pos;
+	}
+	return pos;
+}
+
+static inline bool token_is(const char *token, const char *token_end,
+			    const char *keyword)
+{
+	size_t len = strlen(keyword);
+	return (size_t)(token_end - token) == len
+	    && strncasecmp(token, keyword, len) == 0;
+}
+
+/*
+* Parse an unsigned number of at most 64 bits. Return false on bad digits or
+* overflow.
+*/
+static bool parse_number(const char *digits, const char *end, byte base,
+			 unsigned long long *value)
+{
+	if (digits == end) {
+		return false;
+	}
+
+	unsigned long long number = 0;
+	for (; digits < end; ++digits) {
+		int digit = digit_value(*digits);
+		if (digit < 0 || digit >= base
+		    || __builtin_mul_overflow(number, base, &number)
+		    || __builtin_add_overflow(number, digit, &number)) {
+			return false;
+		}
+	}
+	*value = number;
+	return true;
+}
+
+/*
+* Decode a data value into <word> (ceil(width / 8) bytes, little-endian). HEX
+* is decoded nibble by nibble from the end; other radices accumulate with a
+* multi-precision multiply-add. Negative values are stored in two's
+* complement, truncated to <width> bits.
+*/
+static bool decode_value(const char *digits, const char *end,
+			 const struct radix *radix, byte *word,
+			 unsigned int width)
+{
+	const size_t word_size = ((size_t)width + 7) / 8;
+	const byte top_mask = (width % 8 != 0 ? (1 << (width % 8)) - 1 : 0xff);
+
+	bool negative = (digits < end && *digits == '-');
+	if (negative) {
+		++digits;
+		if (!radix->is_signed) {
+			return false;
+		}
+	}
+	if (digits == end) {
+		return false;
+	}
+
+	memset(word, 0, word_size);
+
+	if (radix->base == 16) {
+		size_t nibble = 0;
+		for (const char *pos = end; pos > digits; --pos, ++nibble) {
+			int digit = digit_value(pos[-1]);
+			if (digit < 0 || digit >= 16) {
+				return false;
+			}
+			if (nibble / 2 >= word_size) {
+				if (digit != 0) {
+					return false;
+				}
+				continue;
+			}
+			word[nibble / 2] |= digit << (4 * (nibble % 2));
+		}
+	} else {
+		for (; digits < end; ++digits) {
+			int digit = digit_value(*digits);
+			if (digit < 0 || digit >= radix->base) {
+				return false;
+			}
+
+			unsigned int carry = digit;
+			for (size_t idx = 0; idx < word_size; ++idx) {
+				carry += word[idx] * radix->base;
+				word[idx] = carry & 0xff;
+				carry >>= 8;
+			}
+			if (carry != 0) {
+				return false;
+			}
+		}
+	}
+
+	if ((word[word_size - 1] & ~top_mask) != 0) {
+		return false;
+	}
+
+	if (negative) {
+		unsigned int carry = 1;
+		for (size_t idx = 0; idx < word_size; ++idx) {
+			carry += (byte) ~word[idx];
+			word[idx] = carry & 0xff;
+			carry >>= 8;
+		}
+		word[word_size - 1] &= top_mask;
+	}
+	return true;
+}
+
+/*
+* Parse the header up to and including BEGIN. On failure, <*error> points at
+* the offending text.
+*/
+static bool parse_mif_header(const char *text, const char *end,
+			     struct mif_layout *layout, const char **error)
+{
+	layout->depth = -1;
+	layout->width = 0;
+	layout->addr_radix = find_radix("HEX", 3);
+	layout->data_radix = find_radix("HEX", 3);
+
+	const char *pos = skip_blanks(text, end);
+	while (true) {
+		*error = pos;
+		const char *key = pos;
+		const char *key_end = token_end(pos, end);
+		if (key == key_end) {
+			return false;
+		}
+
+		pos = skip_blanks(key_end, end);
+		if (token_is(key, key_end, "CONTENT")) {
+			const char *begin = pos;
+			pos = token_end(pos, end);
+			if (!token_is(begin, pos, "BEGIN")) {
+				*error = begin;
+				return false;
+			}
+			break;
+		}
+
+		if (pos == end || *pos != '=') {
+			*error = pos;
+			return false;
+		}
+		const char *value = skip_blanks(pos + 1, end);
+		const char *value_end = token_end(value, end);
+		pos = skip_blanks(value_end, end);
+		if (pos == end || *pos != ';') {
+			*error = pos;
+			return false;
+		}
+		pos = skip_blanks(pos + 1, end);
+
+		unsigned long long number = 0;
+		*error = value;
+		if (token_is(key, key_end, "DEPTH")) {
+			if (!parse_number(value, value_end, 10, &number)
+			    || number > LLONG_MAX) {
+				return false;
+			}
+			layout->depth = number;
+		} else if (token_is(key, key_end, "WIDTH")) {
+			if (!parse_number(value, value_end, 10, &number)
+			    || number == 0 || number > UINT_MAX) {
+				return false;
+			}
+			layout->width = number;
+		} else if (token_is(key, key_end, "ADDRESS_RADIX")) {
+			layout->addr_radix = find_radix(value, value_end - value);
+			if (layout->addr_radix == NULL) {
+				return false;
+			}
+		} else if (token_is(key, key_end, "DATA_RADIX")) {
+			layout->data_radix = find_radix(value, value_end - value);
+			if (layout->data_radix == NULL) {
+				return false;
+			}
+		} else {
+			*error = key;
+			return false;
+		}
+	}
+
+	// The image must be addressable in bits
+	*error = text;
+	if (layout->depth < 0 || layout->width == 0
+	    || layout->depth > LLONG_MAX / layout->width) {
+		return false;
+	}
+	layout->word_size = ((size_t)layout->width + 7) / 8;
+	layout->content = pos;
+
+	// Find the END keyword from the back, so the content can be split
+	// without parsing it first
+	layout->content_end = end;
+	const char *tail = end;
+	while (tail > pos && (tail[-1] == ' ' || tail[-1] == '\t'
+			      || tail[-1] == '\n' || tail[-1] == '\r'
+			      || tail[-1] == ';')) {
+		--tail;
+	}
+	if (tail - pos >= 3 && token_is(tail - 3, tail, "END")) {
+		layout->content_end = tail - 3;
+	}
+	return true;
+}
+
+static unsigned long line_number(const char *text, const char *pos)
+{
+	unsigned long line = 1;
+	for (; text < pos; ++text) {
+		line += (*text == '\n');
+	}
+	return line;
+}
+
+/////////////////////////////////// Encoder ///////////////////////////////////
+
+enum encoder_state {
+	ENCODER_HEADER,
+	ENCODER_RECORDS,
+	ENCODER_TRAILER,
+	ENCODER_DONE
+};
+
+struct mif_encoder {
+	struct mif_config config;
+	struct record_format fmt;
+	enum encoder_state state;
+	bool finished;
+
+	long long next_addr;	// words consumed
+	char addr_template[ADDR_TEMPLATE_SIZE];	// record prefix of next_addr
+
+	byte *partial;		// unit split across spans
+	size_t partial_len;
+	size_t unit_words;	// whole records that start on a byte
+	size_t unit_size;	// bytes of input per unit
+	size_t swap_group;	// bytes; 0 for little-endian input
+
+	byte *staged;		// words unpacked or swapped from the input
+	size_t staged_cap;
+	size_t staged_len;
+	size_t staged_pos;
+
+	byte *run_word;		// range being collected
+	long long run_start;
+	long long run_len;
+
+	// Output that did not fit into the caller's buffer
+	char *pending;
+	size_t pending_len;
+	size_t pending_pos;
+
+	char *sink_buffer;	// SINK_BUFFER_SIZE bytes, on the first write
+};
+
+static pthread_once_t LIBRARY_ONCE = PTHREAD_ONCE_INIT;
+static hex_kernel HEX_KERNEL = hex_encode_scalar;
+static bin_kernel BIN_KERNEL = bin_encode_scalar;
+static hex_decoder HEX_DECODER = hex_decode_scalar;
+static bit_unpacker BIT_UNPACKER = unpack_bits_scalar;
+static byte_swapper BYTE_SWAPPER = swap_bytes_scalar;
+
+static void init_library(void)
+{
+	init_digit_tables();
+	HEX_KERNEL = select_hex_kernel();
+	BIN_KERNEL = select_bin_kernel();
+	HEX_DECODER = select_hex_decoder();
+	BIT_UNPACKER = select_bit_unpacker();
+	BYTE_SWAPPER = select_byte_swapper();
+}
+
+void mif_config_init(struct mif_config *config, long long depth,
+		     unsigned int width)
+{
+	config->depth = depth;
+	config->width = width;
+	config->address_radix = MIF_RADIX_HEX;
+	config->data_radix = MIF_RADIX_HEX;
+	config->words_per_line = 1;
+	config->byte_order = MIF_ORDER_LITTLE;
+	config->compress = false;
+}
+
+bool mif_swap_words(void *words, size_t nwords, unsigned int width,
+		    enum mif_byte_order order)
+{
+	const long group = swap_group(width, order);
+	if (group < 0) {
+		errno = EINVAL;
+		return false;
+	}
+	if (group > 0) {
+		(void)pthread_once(&LIBRARY_ONCE, init_library);
+		BYTE_SWAPPER(words, words, nwords, width / 8, group);
+	}
+	return true;
+}
+
+/*
+* Longest piece of output produced at once: a range record
+*/
+static inline size_t max_run_len(const struct record_format *fmt)
+{
+	return 2 * fmt->addr_repr_width + 9 + fmt->data_len;
+}
+
+/*
+* Number of words in an input unit: a whole number of records that starts on
+* a byte, i.e. a multiple of 8 words when they are bit-packed
+*/
+static inline size_t words_per_unit(const struct record_format *fmt)
+{
+	size_t words = fmt->words_per_line;
+	if (fmt->width % 8 != 0) {
+		while (words % 8 != 0) {
+			words += fmt->words_per_line;
+		}
+	}
+	return words;
+}
+
+/*
+* Number of words staged at once: whole units, so every block starts a record
+* on a byte
+*/
+static inline size_t unpack_block_len(const struct record_format *fmt)
+{
+	const size_t unit = words_per_unit(fmt);
+	size_t nwords = UNPACK_BUFFER_SIZE / fmt->word_size / unit * unit;
+	return nwords > 0 ? nwords : unit;
+}
+
+struct mif_encoder *mif_encoder_create(const struct mif_config *config)
+{
+	const bool decimal = (config->data_radix == MIF_RADIX_DEC
+			      || config->data_radix == MIF_RADIX_UNS);
+	if (config->depth < 0 || config->width == 0
+	    || config->depth > LLONG_MAX / config->width
+	    || (unsigned int)config->address_radix > MIF_RADIX_HEX
+	    || (unsigned int)config->data_radix > MIF_RADIX_HEX
+	    || (decimal && config->width > MIF_MAX_DECIMAL_WIDTH)
+	    || config->words_per_line == 0
+	    || (config->compress && config->words_per_line > 1)
+	    || swap_group(config->width, config->byte_order) < 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	(void)pthread_once(&LIBRARY_ONCE, init_library);
+
+	struct record_format fmt;
+	record_format_init(&fmt, config, HEX_KERNEL, BIN_KERNEL);
+
+	// One aligned block: the staging area, then the unit, word and output
+	// carried over between calls
+	const size_t group = swap_group(config->width, config->byte_order);
+	const bool staged = (config->width % 8 != 0 || group > 0);
+	const size_t unit_size = words_per_unit(&fmt) * config->width / 8;
+	size_t pending_cap = (max_run_len(&fmt) > HEADER_SIZE
+			      ? max_run_len(&fmt) : HEADER_SIZE);
+	if (pending_cap < fmt.record_len) {
+		pending_cap = fmt.record_len;
+	}
+	const size_t staged_cap = (staged ? unpack_block_len(&fmt) : 0);
+	const size_t staged_offset = align_up(sizeof(struct mif_encoder));
+	const size_t partial_offset = align_up(staged_offset
+					       + staged_cap * fmt.word_size);
+	const size_t run_word_offset = align_up(partial_offset + unit_size);
+	const size_t pending_offset = align_up(run_word_offset
+					       + fmt.word_size);
+	struct mif_encoder *enc = alloc_aligned(pending_offset + pending_cap);
+	if (enc == NULL) {
+		return NULL;
+	}
+
+	enc->config = *config;
+	enc->fmt = fmt;
+	enc->state = ENCODER_HEADER;
+	enc->finished = false;
+	enc->next_addr = 0;
+	record_address_init(&enc->fmt, enc->addr_template, 0);
+
+	enc->partial = (byte *)enc + partial_offset;
+	enc->partial_len = 0;
+	enc->unit_words = words_per_unit(&fmt);
+	enc->unit_size = unit_size;
+	enc->swap_group = group;
+	enc->run_word = (byte *)enc + run_word_offset;
+	enc->run_start = 0;
+	enc->run_len = 0;
+
+	enc->pending = (char *)enc + pending_offset;
+	enc->pending_len = 0;
+	enc->pending_pos = 0;
+
+	enc->staged = (byte *)enc + staged_offset;
+	enc->staged_cap = staged_cap;
+	enc->staged_len = 0;
+	enc->staged_pos = 0;
+
+	enc->sink_buffer = NULL;
+	return enc;
+}
+
+void mif_encoder_destroy(struct mif_encoder *enc)
+{
+	if (enc != NULL) {
+		free(enc->sink_buffer);
+	}
+	free(enc);
+}
+
+/*
+* Write a run of <count> copies of <word> starting at <addr> to <dest>, as a
+* range record "[<first>..<last>] : <data>;\n" unless it is a single word.
+* Return the length of the record.
+*/
+static size_t format_run(const struct record_format *fmt, char *dest,
+			 unsigned long long addr, unsigned long long count,
+			 const byte *word)
+{
+	const unsigned int addr_len = fmt->addr_repr_width;
+	char *ptr = dest;
+
+	if (count == 1) {
+		format_number(ptr, addr_len, addr, fmt->addr_base);
+		ptr += addr_len;
+	} else {
+		*ptr++ = '[';
+		format_number(ptr, addr_len, addr, fmt->addr_base);
+		ptr += addr_len;
+		memcpy(ptr, "..", 2);
+		ptr += 2;
+		format_number(ptr, addr_len, addr + count - 1, fmt->addr_base);
+		ptr += addr_len;
+		*ptr++ = ']';
+	}
+	// The separator goes in after the data, over a skipped leading digit
+	fmt->encode_data(fmt, ptr + 3 + fmt->data_len - fmt->data_stride, word,
+			 1);
+	memcpy(ptr, " : ", 3);
+	ptr += 3 + fmt->data_len;
+	memcpy(ptr, ";\n", 2);
+	ptr += 2;
+
+	return ptr - dest;
+}
+
+/*
+* Emit the collected run, straight into <dest> when it is sure to fit
+*/
+static size_t flush_run(struct mif_encoder *enc, char *dest, size_t dest_len)
+{
+	size_t len = 0;
+	if (dest_len >= max_run_len(&enc->fmt)) {
+		len = format_run(&enc->fmt, dest, enc->run_start, enc->run_len,
+				 enc->run_word);
+	} else {
+		enc->pending_len = format_run(&enc->fmt, enc->pending,
+					      enc->run_start, enc->run_len,
+					      enc->run_word);
+		enc->pending_pos = 0;
+	}
+
+	enc->run_len = 0;
+	return len;
+}
+
+/*
+* Emit records for up to <nwords> words; return how many were consumed (at
+* least one) and add the bytes written to <*written>
+*/
+static size_t encode_words(struct mif_encoder *enc, const byte *words,
+			   size_t nwords, char *dest, size_t dest_len,
+			   size_t *written)
+{
+	const struct record_format *fmt = &enc->fmt;
+	const size_t word_size = fmt->word_size;
+
+	long long words_left = enc->config.depth - enc->next_addr;
+	if ((unsigned long long)words_left < nwords) {
+		nwords = words_left;
+	}
+
+	if (enc->config.compress) {
+		size_t idx = 0;
+		while (idx < nwords) {
+			const byte *word = words + idx * word_size;
+			size_t count = run_length(word, nwords - idx, word_size);
+
+			if (enc->run_len > 0
+			    && memcmp(word, enc->run_word, word_size) == 0) {
+				enc->run_len += count;
+				idx += count;
+				continue;
+			}
+
+			bool flushed = true;
+			if (enc->run_len > 0) {
+				size_t len = flush_run(enc, dest + *written,
+						       dest_len - *written);
+				*written += len;
+				flushed = (len > 0);
+			}
+
+			memcpy(enc->run_word, word, word_size);
+			enc->run_start = enc->next_addr + idx;
+			enc->run_len = count;
+			idx += count;
+
+			if (!flushed) {
+				break;	// drain the pending record first
+			}
+		}
+		enc->next_addr += idx;
+		return idx;
+	}
+
+	// Whole records only, unless the last one is short
+	size_t fit = (dest_len - *written) / fmt->record_len
+	    * fmt->words_per_line;
+	if (fit == 0) {
+		size_t count = (nwords < fmt->words_per_line
+				? nwords : fmt->words_per_line);
+		format_records(fmt, enc->pending, words, count,
+			       enc->addr_template);
+		enc->pending_len = records_len(fmt, count);
+		enc->pending_pos = 0;
+		enc->next_addr += count;
+		return count;
+	}
+
+	if (fit < nwords) {
+		nwords = fit;
+	}
+	format_records(fmt, dest + *written, words, nwords, enc->addr_template);
+	*written += records_len(fmt, nwords);
+	enc->next_addr += nwords;
+	return nwords;
+}
+
+/*
+* Bring <nwords> input words into whole little-endian bytes at <dest>
+*/
+static inline void load_words(const struct mif_encoder *enc, byte *dest,
+			      const byte *src, size_t nwords)
+{
+	if (enc->swap_group > 0) {
+		BYTE_SWAPPER(dest, src, nwords, enc->fmt.word_size,
+			     enc->swap_group);
+	} else {
+		BIT_UNPACKER(dest, src, nwords, enc->fmt.width);
+	}
+}
+
+/*
+* Unpack or swap <nwords> words (fewer if the depth is reached sooner); the
+* staged words are encoded before any further input
+*/
+static void stage_words(struct mif_encoder *enc, const byte *src,
+			size_t nwords)
+{
+	long long words_left = enc->config.depth - enc->next_addr;
+	if ((unsigned long long)words_left < nwords) {
+		nwords = words_left;
+	}
+	load_words(enc, enc->staged, src, nwords);
+	enc->staged_len = nwords;
+	enc->staged_pos = 0;
+}
+
+/*
+* Take up to <nunits> input units. Return how many were consumed (at least
+* one); the last unit before the depth may hold fewer words.
+*/
+static size_t encode_units(struct mif_encoder *enc, const byte *units,
+			   size_t nunits, char *dest, size_t dest_len,
+			   size_t *written)
+{
+	const size_t unit_words = enc->unit_words;
+	if (enc->staged_cap == 0) {
+		size_t nwords = encode_words(enc, units, nunits * unit_words,
+					     dest, dest_len, written);
+		return (nwords + unit_words - 1) / unit_words;
+	}
+
+	if (nunits > enc->staged_cap / unit_words) {
+		nunits = enc->staged_cap / unit_words;
+	}
+	stage_words(enc, units, unit_words * nunits);
+	return nunits;
+}
+
+/*
+* No more words will be taken: flush the last range and move on to the trailer
+*/
+static size_t end_records(struct mif_encoder *enc, char *dest, size_t dest_len)
+{
+	size_t len = 0;
+	if (enc->run_len > 0) {
+		len = flush_run(enc, dest, dest_len);
+	}
+	enc->state = ENCODER_TRAILER;
+	return len;
+}
+
+size_t mif_encoder_encode(struct mif_encoder *enc, const void **src,
+			  size_t *src_len, char *dest, size_t dest_len)
+{
+	const size_t word_size = enc->fmt.word_size;
+	const size_t unit_size = enc->unit_size;
+	const size_t unit_words = enc->unit_words;
+	const byte *input = (src != NULL ? *src : NULL);
+	size_t input_len = (src_len != NULL ? *src_len : 0);
+	size_t written = 0;
+
+	while (true) {
+		// Hand out what is left of the last piece first
+		if (enc->pending_pos < enc->pending_len) {
+			size_t len = enc->pending_len - enc->pending_pos;
+			if (len > dest_len - written) {
+				len = dest_len - written;
+			}
+			memcpy(dest + written, enc->pending + enc->pending_pos,
+			       len);
+			enc->pending_pos += len;
+			written += len;
+			if (enc->pending_pos < enc->pending_len) {
+				break;
+			}
+		}
+
+		if (enc->state == ENCODER_HEADER) {
+			enc->pending_len =
+			    snprintf(enc->pending, HEADER_SIZE,
+				     "DEPTH = %lld;\n"
+				     "WIDTH = %u;\n"
+				     "ADDRESS_RADIX = %s;\n"
+				     "DATA_RADIX = %s;\n"
+				     "CONTENT\n"
+				     "BEGIN\n",
+				     enc->config.depth, enc->config.width,
+				     RADICES[enc->config.address_radix].name,
+				     RADICES[enc->config.data_radix].name);
+			enc->pending_pos = 0;
+			enc->state = ENCODER_RECORDS;
+			continue;
+		}
+		if (enc->state == ENCODER_TRAILER) {
+			enc->pending_len = strlen(MIF_TRAILER);
+			enc->pending_pos = 0;
+			memcpy(enc->pending, MIF_TRAILER, enc->pending_len);
+			enc->state = ENCODER_DONE;
+			continue;
+		}
+		if (enc->state == ENCODER_DONE) {
+			break;
+		}
+
+		long long words_left = enc->config.depth - enc->next_addr;
+		if (words_left == 0) {
+			written += end_records(enc, dest + written,
+					       dest_len - written);
+			continue;
+		}
+
+		// Words unpacked from bit-packed input go first
+		if (enc->staged_pos < enc->staged_len) {
+			enc->staged_pos +=
+			    encode_words(enc,
+					 enc->staged + enc->staged_pos * word_size,
+					 enc->staged_len - enc->staged_pos,
+					 dest, dest_len, &written);
+			continue;
+		}
+
+		// Complete a unit split across spans
+		if (enc->partial_len > 0) {
+			size_t len = unit_size - enc->partial_len;
+			if (len > input_len) {
+				len = input_len;
+			}
+			if (len > 0) {
+				memcpy(enc->partial + enc->partial_len, input,
+				       len);
+			}
+			enc->partial_len += len;
+			input += len;
+			input_len -= len;
+
+			if (enc->partial_len < unit_size) {
+				if (!enc->finished) {
+					break;
+				}
+
+				// A short last unit still holds whole words
+				size_t nwords = enc->partial_len * 8
+				    / enc->fmt.width;
+				if (nwords > 0) {
+					enc->partial_len = 0;
+					if (enc->staged_cap > 0) {
+						stage_words(enc, enc->partial,
+							    nwords);
+					} else {
+						(void)encode_words(enc,
+								   enc->partial,
+								   nwords, dest,
+								   dest_len,
+								   &written);
+					}
+					continue;
+				}
+				written += end_records(enc, dest + written,
+						       dest_len - written);
+				continue;
+			}
+
+			enc->partial_len = 0;
+			(void)encode_units(enc, enc->partial, 1, dest,
+					   dest_len, &written);
+			continue;
+		}
+
+		size_t nunits = input_len / unit_size;
+		unsigned long long units_left = (words_left + unit_words - 1)
+		    / unit_words;
+		if (units_left < nunits) {
+			nunits = units_left;
+		}
+		if (nunits == 0) {
+			if (input_len > 0) {
+				memcpy(enc->partial, input, input_len);
+			}
+			enc->partial_len = input_len;
+			input += input_len;
+			input_len = 0;
+
+			if (!enc->finished) {
+				break;
+			}
+			written += end_records(enc, dest + written,
+					       dest_len - written);
+			continue;
+		}
+
+		size_t consumed = encode_units(enc, input, nunits, dest,
+					       dest_len, &written);
+		input += consumed * unit_size;
+		input_len -= consumed * unit_size;
+	}
+
+	if (src != NULL) {
+		*src = input;
+		*src_len = input_len;
+	}
+	return written;
+}
+
+void mif_encoder_finish(struct mif_encoder *enc)
+{
+	enc->finished = true;
+}
+
+bool mif_encoder_done(const struct mif_encoder *enc)
+{
+	return enc->state == ENCODER_DONE
+	    && enc->pending_pos == enc->pending_len;
+}
+
+long long mif_encoder_words(const struct mif_encoder *enc)
+{
+	return enc->next_addr;
+}
+
+bool mif_encoder_write(struct mif_encoder *enc, const void *src,
+		       size_t src_len, mif_sink sink, void *context)
+{
+	// Kept off the stack, which may be small on the caller's thread
+	if (enc->sink_buffer == NULL
+	    && (enc->sink_buffer = malloc(SINK_BUFFER_SIZE)) == NULL) {
+		return false;
+	}
+
+	while (true) {
+		size_t len = mif_encoder_encode(enc, &src, &src_len,
+						enc->sink_buffer,
+						SINK_BUFFER_SIZE);
+		if (len > 0 && !sink(context, enc->sink_buffer, len)) {
+			return false;
+		}
+		if (len < SINK_BUFFER_SIZE) {
+			return true;
+		}
+	}
+}
+
+bool mif_encoder_close(struct mif_encoder *enc, mif_sink sink, void *context)
+{
+	mif_encoder_finish(enc);
+	return mif_encoder_write(enc, NULL, 0, sink, context);
+}
+
+size_t mif_encoder_record_len(const struct mif_encoder *enc)
+{
+	return enc->config.compress ? 0 : enc->fmt.record_len;
+}
+
+size_t mif_encoder_records_len(const struct mif_encoder *enc, long long nwords)
+{
+	return enc->config.compress ? 0 : records_len(&enc->fmt, nwords);
+}
+
+bool mif_encoder_format(const struct mif_encoder *enc, char *dest,
+			const void *words, size_t nwords, long long first_addr)
+{
+	char addr_template[ADDR_TEMPLATE_SIZE];
+	record_address_init(&enc->fmt, addr_template, first_addr);
+	if (enc->staged_cap == 0) {
+		format_records(&enc->fmt, dest, words, nwords, addr_template);
+		return true;
+	}
+
+	// Bit-packed or swapped words are staged a block at a time
+	const size_t block_len = unpack_block_len(&enc->fmt);
+	byte *block_words = alloc_aligned(block_len * enc->fmt.word_size);
+	if (block_words == NULL) {
+		return false;
+	}
+
+	const byte *src = words;
+	while (nwords > 0) {
+		size_t block = (nwords < block_len ? nwords : block_len);
+		load_words(enc, block_words, src, block);
+		format_records(&enc->fmt, dest, block_words, block,
+			       addr_template);
+
+		dest += records_len(&enc->fmt, block);
+		src += block * enc->fmt.width / 8;
+		nwords -= block;
+	}
+
+	free(block_words);
+	return true;
+}
+
+void mif_encoder_advance(struct mif_encoder *enc, long long nwords)
+{
+	enc->next_addr += nwords;
+	if (enc->next_addr > enc->config.depth) {
+		enc->next_addr = enc->config.depth;
+	}
+	record_address_init(&enc->fmt, enc->addr_template, enc->next_addr);
+}
+
+/////////////////////////////////// Loader ////////////////////////////////////
+
+/*
+* A parsed record: [first..last] : values; (a plain record is a range over as
+* many addresses as it has values)
+*/
+struct mif_record {
+	unsigned long long first;
+	unsigned long long last;
+	const char *values;
+	size_t nvalues;
+};
+
+/*
+* Parse the record at <pos> and return the position after it, or NULL with
+* <*error> pointing at the offending text
+*/
+static const char *parse_record(const struct mif_layout *layout,
+				const char *pos, const char *end,
+				struct mif_record *rec, const char **error)
+{
+	*error = pos;
+	bool is_range = (*pos == '[');
+	if (is_range) {
+		pos = skip_blanks(pos + 1, end);
+	}
+
+	// Address or [first..last] range
+	const char *addr_end = token_end(pos, end);
+	if (!parse_number(pos, addr_end, layout->addr_radix->base,
+			  &rec->first)) {
+		return NULL;
+	}
+	pos = skip_blanks(addr_end, end);
+	rec->last = rec->first;
+
+	if (is_range) {
+		if (end - pos < 2 || pos[0] != '.' || pos[1] != '.') {
+			*error = pos;
+			return NULL;
+		}
+		pos = skip_blanks(pos + 2, end);
+		addr_end = token_end(pos, end);
+		if (!parse_number(pos, addr_end, layout->addr_radix->base,
+				  &rec->last)) {
+			*error = pos;
+			return NULL;
+		}
+		pos = skip_blanks(addr_end, end);
+		if (pos == end || *pos != ']' || rec->last < rec->first) {
+			*error = pos;
+			return NULL;
+		}
+		pos = skip_blanks(pos + 1, end);
+	}
+
+	if (pos == end || *pos != ':') {
+		*error = pos;
+		return NULL;
+	}
+	pos = skip_blanks(pos + 1, end);
+
+	// One or more values; a range repeats them as a pattern
+	rec->values = pos;
+	rec->nvalues = 0;
+	while (pos < end && *pos != ';') {
+		const char *value_end = token_end(pos + (*pos == '-'), end);
+		if (value_end == pos + (*pos == '-')) {
+			*error = pos;
+			return NULL;
+		}
+		++rec->nvalues;
+		pos = skip_blanks(value_end, end);
+	}
+	if (pos == end || rec->nvalues == 0) {
+		*error = pos;
+		return NULL;
+	}
+
+	if (!is_range) {
+		rec->last = rec->first + rec->nvalues - 1;
+	}
+	if (rec->last >= (unsigned long long)layout->depth
+	    || rec->last < rec->first) {
+		*error = rec->values;
+		return NULL;
+	}
+	return pos + 1;		// ';'
+}
+
+/*
+* Decode a full-width HEX value of <ndigits> digits, 2 * word_size or one
+* less, with the vector decoder
+*/
+static inline bool decode_hex_data(byte *word, const char *digits,
+				   size_t ndigits, unsigned int width)
+{
+	const size_t word_size = ((size_t)width + 7) / 8;
+	if (ndigits % 2 != 0) {
+		int digit = digit_value(*digits++);
+		if (digit < 0 || digit >= 16) {
+			return false;
+		}
+		word[word_size - 1] = digit;
+	}
+
+	return HEX_DECODER(word, digits, ndigits / 2)
+	    && (width % 8 == 0 || word[word_size - 1] >> (width % 8) == 0);
+}
+
+/*
+* Decode the words of <rec> that fall into [<first>, <first> + <count>) into
+* <image>, which holds the words from <first> on
+*/
+static bool decode_record(const struct mif_layout *layout,
+			  const struct mif_record *rec, const char *end,
+			  byte *image, unsigned long long first,
+			  unsigned long long count)
+{
+	const size_t word_size = layout->word_size;
+	unsigned long long from = (rec->first > first ? rec->first : first);
+	unsigned long long to = (rec->last < first + count - 1
+				 ? rec->last : first + count - 1);
+	if (from > to) {
+		return true;
+	}
+
+	const char *value = rec->values;
+	for (size_t idx = 0; idx < rec->nvalues; ++idx) {
+		const char *value_end = token_end(value + (*value == '-'), end);
+
+		// Every address this value lands on, the pattern repeating
+		unsigned long long addr = rec->first + idx;
+		if (addr < from) {
+			addr += (from - addr + rec->nvalues - 1) / rec->nvalues
+			    * rec->nvalues;
+		}
+		if (addr <= to) {
+			byte *word = image + (addr - first) * word_size;
+			size_t ndigits = value_end - value;
+			bool decoded = (layout->data_radix->base == 16
+					&& (ndigits == 2u * word_size
+					    || ndigits == 2u * word_size - 1)
+					? decode_hex_data(word, value, ndigits,
+							  layout->width)
+					: decode_value(value, value_end,
+						       layout->data_radix,
+						       word, layout->width));
+			if (!decoded) {
+				return false;
+			}
+			for (addr += rec->nvalues; addr <= to;
+			     addr += rec->nvalues) {
+				memcpy(image + (addr - first) * word_size, word,
+				       word_size);
+			}
+		}
+
+		value = skip_blanks(value_end, end);
+	}
+	return true;
+}
+
+/*
+* Sparse index entry: a group of up to INDEX_STRIDE consecutive records, the
+* addresses they cover and where the first one starts
+*/
+struct index_entry {
+	long long first;
+	long long last;
+	size_t offset;
+	size_t nrecords;
+};
+
+struct mif_loader {
+	const char *text;
+	size_t text_len;
+	bool mapped;		// text is a private mapping of a file
+
+	struct mif_layout layout;
+
+	// Fixed-length layout: the record of <addr> starts at
+	// records + addr / words_per_line * record_len
+	const char *records;
+	size_t addr_len;
+	size_t data_len;
+	size_t words_per_line;
+	size_t record_len;	// 0 when the records are indexed instead
+
+	struct index_entry *index;	// sorted by first address
+	long long *reach;	// highest address covered by index[0..idx]
+	size_t index_len;
+	bool overlapping;	// some addresses are set by several records
+
+	// A file that looks fixed-length but has a record out of place is
+	// indexed on first use instead
+	atomic_bool indexed;	// read through the index
+	bool index_failed;	// the file is malformed
+	pthread_mutex_t index_lock;
+	unsigned int jobs;	// threads to index with
+};
+
+struct index_job {
+	const struct mif_layout *layout;
+	const char *text;
+	const char *begin;
+	const char *end;
+	const char *error;	// NULL on success
+
+	struct index_entry *entries;
+	size_t nentries;
+	size_t capacity;
+};
+
+static void *index_worker(void *arg)
+{
+	struct index_job *job = arg;
+	const char *pos = job->begin;
+
+	while ((pos = skip_blanks(pos, job->end)) < job->end) {
+		if (token_is(pos, token_end(pos, job->end), "END")) {
+			break;
+		}
+
+		struct mif_record rec;
+		const char *next = parse_record(job->layout, pos, job->end,
+						&rec, &job->error);
+		if (next == NULL) {
+			return NULL;
+		}
+
+		struct index_entry *entry = (job->nentries > 0
+					     ? &job->entries[job->nentries - 1]
+					     : NULL);
+		if (entry != NULL && entry->nrecords < INDEX_STRIDE) {
+			if ((long long)rec.first < entry->first) {
+				entry->first = rec.first;
+			}
+			if ((long long)rec.last > entry->last) {
+				entry->last = rec.last;
+			}
+			++entry->nrecords;
+			pos = next;
+			continue;
+		}
+
+		if (job->nentries == job->capacity) {
+			size_t capacity = (job->capacity == 0 ? 1024
+					   : 2 * job->capacity);
+			struct index_entry *grown =
+			    realloc(job->entries,
+				    capacity * sizeof(struct index_entry));
+			if (grown == NULL) {
+				job->error = pos;
+				return NULL;
+			}
+			job->entries = grown;
+			job->capacity = capacity;
+		}
+
+		job->entries[job->nentries++] = (struct index_entry) {
+			.first = rec.first,
+			.last = rec.last,
+			.offset = pos - job->text,
+			.nrecords = 1,
+		};
+		pos = next;
+	}
+
+	job->error = NULL;
+	return NULL;
+}
+
+/*
+* Split the content into at most <npieces> pieces. Every cut is placed after
+* the end of a line that finishes a record (ends with ';'), so no record
+* straddles two pieces. Return the number of pieces.
+*/
+static size_t split_content(const struct mif_layout *layout,
+			    struct index_job *pieces, size_t npieces)
+{
+	const char *begin = layout->content;
+	const char *end = layout->content_end;
+	size_t piece_len = (end - begin) / npieces + 1;
+
+	size_t count = 0;
+	while (begin < end) {
+		const char *cut = (end - begin > (ptrdiff_t)piece_len
+				   ? begin + piece_len : end);
+
+		while (cut < end) {
+			const char *newline = memchr(cut, '\n', end - cut);
+			if (newline == NULL) {
+				cut = end;
+				break;
+			}
+
+			const char *last = newline;
+			while (last > cut && (last[-1] == ' ' || last[-1] == '\t'
+					      || last[-1] == '\r')) {
+				--last;
+			}
+			cut = newline + 1;
+			if (last > begin && last[-1] == ';') {
+				break;
+			}
+		}
+
+		pieces[count].begin = begin;
+		pieces[count].end = cut;
+		++count;
+		begin = cut;
+	}
+
+	return count;
+}
+
+static int compare_entries(const void *lhs, const void *rhs)
+{
+	const struct index_entry *left = lhs;
+	const struct index_entry *right = rhs;
+
+	if (left->first != right->first) {
+		return left->first < right->first ? -1 : 1;
+	}
+	return (left->offset > right->offset) - (left->offset < right->offset);
+}
+
+static int compare_offsets(const void *lhs, const void *rhs)
+{
+	const struct index_entry *const *left = lhs;
+	const struct index_entry *const *right = rhs;
+
+	return ((*left)->offset > (*right)->offset)
+	    - ((*left)->offset < (*right)->offset);
+}
+
+/*
+* Index every record, parsing pieces of the content on up to <jobs> threads.
+* On failure, <*error> points at the offending text.
+*/
+static bool build_index(struct mif_loader *loader, unsigned int jobs,
+			const char **error)
+{
+	const struct mif_layout *layout = &loader->layout;
+
+	// Block comments may hide record ends, so they are parsed in one piece
+	size_t content_len = layout->content_end - layout->content;
+	if (jobs == 0 || memchr(layout->content, '%', content_len) != NULL) {
+		jobs = 1;
+	}
+
+	bool retval = false;
+	*error = layout->content;
+	struct index_job *pieces = calloc(jobs, sizeof(struct index_job));
+	pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+	if (pieces == NULL || threads == NULL) {
+		goto cleanup;
+	}
+
+	size_t npieces = split_content(layout, pieces, jobs);
+	size_t nthreads = 1;
+	for (size_t idx = 0; idx < npieces; ++idx) {
+		pieces[idx].layout = layout;
+		pieces[idx].text = loader->text;
+	}
+	for (; nthreads < npieces; ++nthreads) {
+		if (pthread_create(&threads[nthreads], NULL, index_worker,
+				   &pieces[nthreads]) != 0) {
+			break;
+		}
+	}
+	// The calling thread takes the first piece and any that could not
+	// get a thread of their own
+	for (size_t idx = 0; idx < npieces; idx = (idx == 0 ? nthreads
+						   : idx + 1)) {
+		(void)index_worker(&pieces[idx]);
+	}
+	for (size_t idx = 1; idx < nthreads; ++idx) {
+		(void)pthread_join(threads[idx], NULL);
+	}
+
+	size_t total = 0;
+	for (size_t idx = 0; idx < npieces; ++idx) {
+		if (pieces[idx].error != NULL) {
+			*error = pieces[idx].error;
+			goto cleanup;
+		}
+		total += pieces[idx].nentries;
+	}
+
+	loader->index = malloc((total + 1) * sizeof(struct index_entry));
+	loader->reach = malloc((total + 1) * sizeof(long long));
+	if (loader->index == NULL || loader->reach == NULL) {
+		goto cleanup;
+	}
+	for (size_t idx = 0; idx < npieces; ++idx) {
+		memcpy(loader->index + loader->index_len, pieces[idx].entries,
+		       pieces[idx].nentries * sizeof(struct index_entry));
+		loader->index_len += pieces[idx].nentries;
+	}
+
+	// Records are usually in address order already
+	for (size_t idx = 1; idx < loader->index_len; ++idx) {
+		if (compare_entries(&loader->index[idx - 1],
+				    &loader->index[idx]) > 0) {
+			qsort(loader->index, loader->index_len,
+			      sizeof(struct index_entry), compare_entries);
+			break;
+		}
+	}
+
+	long long reach = -1;
+	for (size_t idx = 0; idx < loader->index_len; ++idx) {
+		if (loader->index[idx].first <= reach) {
+			loader->overlapping = true;
+		}
+		if (loader->index[idx].last > reach) {
+			reach = loader->index[idx].last;
+		}
+		loader->reach[idx] = reach;
+	}
+	retval = true;
+
+ cleanup:
+	if (pieces != NULL) {
+		for (size_t idx = 0; idx < jobs; ++idx) {
+			free(pieces[idx].entries);
+		}
+	}
+	free(pieces);
+	free(threads);
+	return retval;
+}
+
+/*
+* Check the separators and the address of fixed-length record <rec_idx>; the
+* spaces between its values are checked as they are decoded
+*/
+static inline bool check_fixed_record(const struct mif_loader *loader,
+				      long long rec_idx)
+{
+	const long long first = rec_idx * loader->words_per_line;
+	const long long words_left = loader->layout.depth - first;
+	const size_t count = (words_left < (long long)loader->words_per_line
+			      ? (size_t)words_left : loader->words_per_line);
+	const char *rec = loader->records + rec_idx * loader->record_len;
+	const size_t rec_len = loader->addr_len + 3
+	    + count * (loader->data_len + 1) + 1;
+	unsigned long long rec_addr = 0;
+
+	return memcmp(rec + loader->addr_len, " : ", 3) == 0
+	    && memcmp(rec + rec_len - 2, ";\n", 2) == 0
+	    && parse_number(rec, rec + loader->addr_len,
+			    loader->layout.addr_radix->base, &rec_addr)
+	    && rec_addr == (unsigned long long)first;
+}
+
+/*
+* Recognise the layout bin2mif writes without ranges: records in address
+* order, each with the same number of values (the last one possibly fewer),
+* all of the same length
+*/
+static void detect_fixed_layout(struct mif_loader *loader)
+{
+	const struct mif_layout *layout = &loader->layout;
+	if (layout->depth == 0) {
+		return;
+	}
+
+	const char *records = skip_blanks(layout->content, layout->content_end);
+	const size_t records_len = layout->content_end - records;
+	loader->records = records;
+	loader->addr_len = token_end(records, layout->content_end) - records;
+	loader->data_len = data_field_len(layout->width, layout->data_radix);
+
+	// Count the values of the first record
+	const char *pos = records + loader->addr_len + 3;
+	size_t words_per_line = 0;
+	while (true) {
+		pos += loader->data_len;
+		++words_per_line;
+		if (pos >= layout->content_end || *pos != ' ') {
+			break;
+		}
+		++pos;
+	}
+	loader->words_per_line = words_per_line;
+	loader->record_len = loader->addr_len + 3
+	    + words_per_line * (loader->data_len + 1) + 1;
+
+	const unsigned long long nrecords =
+	    (layout->depth + words_per_line - 1) / words_per_line;
+	const size_t last_count = layout->depth - (nrecords - 1)
+	    * words_per_line;
+	const size_t last_len = loader->addr_len + 3
+	    + last_count * (loader->data_len + 1) + 1;
+
+	if (records_len < last_len
+	    || (records_len - last_len) % loader->record_len != 0
+	    || (records_len - last_len) / loader->record_len != nrecords - 1
+	    || !check_fixed_record(loader, 0)
+	    || !check_fixed_record(loader, nrecords - 1)) {
+		loader->record_len = 0;
+	}
+}
+
+static struct mif_loader *open_loader(const char *text, size_t text_len,
+				      bool mapped, unsigned int jobs,
+				      unsigned long *error_line)
+{
+	(void)pthread_once(&LIBRARY_ONCE, init_library);
+
+	struct mif_loader *loader = calloc(1, sizeof(struct mif_loader));
+	if (loader == NULL) {
+		return NULL;
+	}
+	loader->text = text;
+	loader->text_len = text_len;
+	loader->jobs = jobs;
+	(void)pthread_mutex_init(&loader->index_lock, NULL);
+
+	const char *error = NULL;
+	if (!parse_mif_header(text, text + text_len, &loader->layout, &error)) {
+		errno = EINVAL;
+		goto fail;
+	}
+
+	detect_fixed_layout(loader);
+	errno = 0;
+	if (loader->record_len == 0) {
+		if (!build_index(loader, jobs, &error)) {
+			errno = (errno == ENOMEM ? ENOMEM : EINVAL);
+			goto fail;
+		}
+		atomic_init(&loader->indexed, true);
+	}
+
+	loader->mapped = mapped;
+	return loader;
+
+ fail:
+	if (error_line != NULL) {
+		*error_line = line_number(text, error);
+	}
+	int saved_errno = errno;
+	mif_loader_close(loader);
+	errno = saved_errno;
+	return NULL;
+}
+
+struct mif_loader *mif_loader_open(const char *path, unsigned int jobs,
+				   unsigned long *error_line)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	struct stat file_stat;
+	void *map = MAP_FAILED;
+	if (fstat(fd, &file_stat) == 0) {
+		if (file_stat.st_size > 0) {
+			map = mmap(NULL, file_stat.st_size, PROT_READ,
+				   MAP_PRIVATE, fd, 0);
+		} else {
+			errno = EINVAL;
+		}
+	}
+	int saved_errno = errno;
+	(void)close(fd);
+	if (map == MAP_FAILED) {
+		errno = saved_errno;
+		return NULL;
+	}
+
+	struct mif_loader *loader = open_loader(map, file_stat.st_size, true,
+						jobs, error_line);
+	if (loader == NULL) {
+		saved_errno = errno;
+		(void)munmap(map, file_stat.st_size);
+		errno = saved_errno;
+	}
+	return loader;
+}
+
+struct mif_loader *mif_loader_open_text(const char *text, size_t len,
+					unsigned int jobs,
+					unsigned long *error_line)
+{
+	return open_loader(text, len, false, jobs, error_line);
+}
+
+void mif_loader_close(struct mif_loader *loader)
+{
+	if (loader == NULL) {
+		return;
+	}
+	if (loader->mapped) {
+		(void)munmap((void *)loader->text, loader->text_len);
+	}
+	free(loader->index);
+	free(loader->reach);
+	(void)pthread_mutex_destroy(&loader->index_lock);
+	free(loader);
+}
+
+long long mif_loader_depth(const struct mif_loader *loader)
+{
+	return loader->layout.depth;
+}
+
+unsigned int mif_loader_width(const struct mif_loader *loader)
+{
+	return loader->layout.width;
+}
+
+bool mif_loader_is_fixed(const struct mif_loader *loader)
+{
+	return !atomic_load_explicit(&loader->indexed, memory_order_acquire);
+}
+
+/*
+* Index of the first entry that may cover <addr>; reach never decreases, so
+* it is found by binary search
+*/
+static size_t first_candidate(const struct mif_loader *loader, long long addr)
+{
+	size_t low = 0;
+	size_t high = loader->index_len;
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		if (loader->reach[mid] < addr) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+/*
+* Parse the record at or after <pos>; return the position after it, or NULL
+*/
+static inline const char *next_record(const struct mif_layout *layout,
+				      const char *pos, struct mif_record *rec)
+{
+	const char *error = NULL;
+	return parse_record(layout, skip_blanks(pos, layout->content_end),
+			    layout->content_end, rec, &error);
+}
+
+/*
+* Decode the indexed records overlapping [<first>, <first> + <count>). Where
+* records overlap, they are applied in file order, so the last one wins.
+* Return the number of words decoded, as mif_loader_decode does.
+*/
+static long long decode_indexed(const struct mif_loader *loader, byte *image,
+				long long first, long long count)
+{
+	const struct mif_layout *layout = &loader->layout;
+	const struct index_entry **order = NULL;
+	size_t ncandidates = 0;
+	long long retval = 0;
+
+	// Addresses no record covers read as zero
+	memset(image, 0, count * layout->word_size);
+
+	size_t begin = first_candidate(loader, first);
+	size_t end = begin;
+	while (end < loader->index_len
+	       && loader->index[end].first < first + count) {
+		++end;
+	}
+
+	if (loader->overlapping) {
+		order = malloc((end - begin + 1) * sizeof(*order));
+		if (order == NULL) {
+			return 0;
+		}
+		for (size_t idx = begin; idx < end; ++idx) {
+			if (loader->index[idx].last >= first) {
+				order[ncandidates++] = &loader->index[idx];
+			}
+		}
+		qsort(order, ncandidates, sizeof(*order), compare_offsets);
+	}
+
+	for (size_t idx = 0; idx < (order != NULL ? ncandidates : end - begin);
+	     ++idx) {
+		const struct index_entry *entry =
+		    (order != NULL ? order[idx] : &loader->index[begin + idx]);
+		if (entry->last < first) {
+			continue;
+		}
+
+		const char *pos = loader->text + entry->offset;
+		for (size_t rec_idx = 0; rec_idx < entry->nrecords; ++rec_idx) {
+			struct mif_record rec;
+			pos = next_record(layout, pos, &rec);
+			if (pos == NULL) {
+				errno = EINVAL;
+				goto cleanup;
+			}
+			if (!decode_record(layout, &rec, layout->content_end,
+					   image, first, count)) {
+				// A bad value; report the start of its record
+				errno = EINVAL;
+				retval = ((long long)rec.first > first
+					  ? (long long)rec.first - first : 0);
+				goto cleanup;
+			}
+		}
+	}
+	retval = count;
+
+ cleanup:
+	free(order);
+	return retval;
+}
+
+/*
+* Index a file whose fixed-length layout failed a check, once, for every
+* thread. Return false with errno set if it cannot be indexed.
+*/
+static bool index_fallback(const struct mif_loader *loader)
+{
+	struct mif_loader *shared = (struct mif_loader *)loader;
+	if (atomic_load_explicit(&shared->indexed, memory_order_acquire)) {
+		return true;
+	}
+
+	(void)pthread_mutex_lock(&shared->index_lock);
+	if (!atomic_load_explicit(&shared->indexed, memory_order_relaxed)
+	    && !shared->index_failed) {
+		const char *error = NULL;
+		errno = 0;
+		if (build_index(shared, shared->jobs, &error)) {
+			atomic_store_explicit(&shared->indexed, true,
+					      memory_order_release);
+		} else {
+			// Out of memory may pass; a malformed file stays so
+			shared->index_failed = (errno != ENOMEM);
+			free(shared->index);
+			free(shared->reach);
+			shared->index = NULL;
+			shared->reach = NULL;
+			shared->index_len = 0;
+			shared->overlapping = false;
+		}
+	}
+	bool retval = atomic_load_explicit(&shared->indexed,
+					   memory_order_relaxed);
+	int error = (shared->index_failed ? EINVAL : ENOMEM);
+	(void)pthread_mutex_unlock(&shared->index_lock);
+
+	if (!retval) {
+		errno = error;
+	}
+	return retval;
+}
+
+long long mif_loader_decode(const struct mif_loader *loader, void *image,
+			    long long first, long long count)
+{
+	const struct mif_layout *layout = &loader->layout;
+	const size_t word_size = layout->word_size;
+
+	if (first < 0 || count < 0 || first > layout->depth - count) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (count == 0) {
+		return 0;
+	}
+
+	if (atomic_load_explicit(&loader->indexed, memory_order_acquire)) {
+		return decode_indexed(loader, image, first, count);
+	}
+
+	// Fixed-length records: straight to the data of every word
+	const bool hex = (layout->data_radix->base == 16);
+	const size_t words_per_line = loader->words_per_line;
+	long long rec_idx = first / words_per_line;
+	size_t column = first % words_per_line;
+	const char *rec = loader->records + rec_idx * loader->record_len;
+	byte *word = image;
+	for (long long idx = 0; idx < count; ++idx) {
+		const char *data = rec + loader->addr_len + 3
+		    + column * (loader->data_len + 1);
+		if (((column == 0 || idx == 0)
+		     && !check_fixed_record(loader, rec_idx))
+		    || (column > 0 && data[-1] != ' ')
+		    || !(hex ? decode_hex_data(word, data, loader->data_len,
+					       layout->width)
+			 : decode_value(data, data + loader->data_len,
+					layout->data_radix, word,
+					layout->width))) {
+			// Valid records may just be out of address order
+			if (index_fallback(loader)) {
+				return decode_indexed(loader, image, first,
+						      count);
+			}
+			return idx;
+		}
+		if (++column == words_per_line) {
+			column = 0;
+			++rec_idx;
+			rec += loader->record_len;
+		}
+		word += word_size;
+	}
+	return count;
+}
+
+bool mif_loader_read(const struct mif_loader *loader, long long addr,
+		     void *word)
+{
+	return mif_loader_decode(loader, word, addr, 1) == 1;
+}
+
+unsigned long mif_loader_line(const struct mif_loader *loader, long long addr)
+{
+	const char *rec = NULL;
+	if (addr < 0 || addr >= loader->layout.depth) {
+		return 0;
+	}
+
+	if (!atomic_load_explicit(&loader->indexed, memory_order_acquire)) {
+		rec = loader->records
+		    + addr / loader->words_per_line * loader->record_len;
+	} else {
+		// The record that sets <addr> last
+		for (size_t idx = first_candidate(loader, addr);
+		     idx < loader->index_len
+		     && loader->index[idx].first <= addr; ++idx) {
+			const struct index_entry *entry = &loader->index[idx];
+			const char *pos = loader->text + entry->offset;
+			if (entry->last < addr
+			    || (rec != NULL && pos < rec)) {
+				continue;
+			}
+
+			for (size_t rec_idx = 0; rec_idx < entry->nrecords;
+			     ++rec_idx) {
+				struct mif_record record;
+				const char *start = skip_blanks(pos,
+								loader->layout.
+								content_end);
+				pos = next_record(&loader->layout, start,
+						  &record);
+				if (pos == NULL) {
+					break;
+				}
+				if (record.first <= (unsigned long long)addr
+				    && record.last >= (unsigned long long)addr) {
+					rec = start;
+				}
+			}
+		}
+	}
+
+	return rec != NULL ? line_number(loader->text, rec) : 0;
+}
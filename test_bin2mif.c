@@ -0,0 +1,578 @@
+/*
+* Tests of libbin2mif through its public interface: encoder output is read
+* back with the loader across widths, radices, byte orders and layouts, and
+* hand-written files cover sparse and overlapping records and malformed input.
+* Exits with status 1 if any check fails.
+*/
+
+#include "bin2mif.h"
+
+#include <errno.h>		// errno, EINVAL
+#include <pthread.h>		// pthread_create, pthread_join
+#include <stdint.h>		// uint64_t
+#include <stdio.h>		// fprintf
+#include <stdlib.h>		// malloc, realloc, free
+#include <string.h>		// memcmp, memcpy, strlen
+
+#define NTHREADS 4		// threads formatting or decoding at once
+#define CHUNK_WORDS 240		// words per thread; a multiple of 8 and of 3
+
+static unsigned int FAILURES = 0;
+
+#define CHECK(cond, ...)						\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: %s: ", __FILE__,	\
+				__LINE__, #cond);			\
+			fprintf(stderr, __VA_ARGS__);			\
+			fputc('\n', stderr);				\
+			++FAILURES;					\
+		}							\
+	} while (0)
+
+/////////////////////////////////// Helpers ///////////////////////////////////
+
+static uint64_t RANDOM_STATE = 0x9e3779b97f4a7c15;
+
+static unsigned char random_byte(void)
+{
+	RANDOM_STATE ^= RANDOM_STATE << 13;
+	RANDOM_STATE ^= RANDOM_STATE >> 7;
+	RANDOM_STATE ^= RANDOM_STATE << 17;
+	return (unsigned char)(RANDOM_STATE >> 32);
+}
+
+struct text {
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+static bool text_sink(void *context, const char *data, size_t len)
+{
+	struct text *text = context;
+	if (text->len + len > text->cap) {
+		size_t cap = 2 * (text->len + len);
+		char *grown = realloc(text->data, cap);
+		if (grown == NULL) {
+			return false;
+		}
+		text->data = grown;
+		text->cap = cap;
+	}
+	memcpy(text->data + text->len, data, len);
+	text->len += len;
+	return true;
+}
+
+/*
+* Encode <input_len> bytes of <input> with <config> into <text>, in two spans
+* split at an odd offset so that a word is carried across them
+*/
+static bool encode_text(const struct mif_config *config,
+			const unsigned char *input, size_t input_len,
+			struct text *text)
+{
+	struct mif_encoder *enc = mif_encoder_create(config);
+	if (enc == NULL) {
+		return false;
+	}
+
+	size_t split = (input_len / 2) | 1;
+	if (split > input_len) {
+		split = input_len;
+	}
+	bool ok = (mif_encoder_write(enc, input, split, text_sink, text)
+		   && mif_encoder_write(enc, input + split, input_len - split,
+					text_sink, text)
+		   && mif_encoder_close(enc, text_sink, text)
+		   && mif_encoder_done(enc)
+		   && mif_encoder_words(enc) == config->depth);
+	mif_encoder_destroy(enc);
+	return ok;
+}
+
+/*
+* Pack the little-endian words of <image> into <nwords> * <width> bits of
+* <input>, least significant bit first
+*/
+static void pack_bits(unsigned char *input, const unsigned char *image,
+		      size_t nwords, unsigned int width)
+{
+	const size_t word_size = (width + 7) / 8;
+	memset(input, 0, (nwords * width + 7) / 8);
+	for (size_t idx = 0; idx < nwords; ++idx) {
+		for (unsigned int bit = 0; bit < width; ++bit) {
+			size_t src = idx * word_size * 8 + bit;
+			size_t dest = idx * width + bit;
+			if (image[src / 8] >> (src % 8) & 1) {
+				input[dest / 8] |= 1 << (dest % 8);
+			}
+		}
+	}
+}
+
+/*
+* Line of the record at byte <pos> of <text>
+*/
+static unsigned long line_at(const char *text, size_t pos)
+{
+	unsigned long line = 1;
+	for (size_t idx = 0; idx < pos; ++idx) {
+		line += (text[idx] == '\n');
+	}
+	return line;
+}
+
+////////////////////////////////// Threading //////////////////////////////////
+
+struct thread_task {
+	const struct mif_encoder *enc;
+	const struct mif_loader *loader;
+	const unsigned char *words;	// input of the encoder
+	unsigned char *image;	// output of the loader
+	char *dest;		// output of the encoder
+	long long first;
+	long long count;
+	bool ok;
+};
+
+static void *format_task(void *arg)
+{
+	struct thread_task *task = arg;
+	task->ok = mif_encoder_format(task->enc, task->dest, task->words,
+				      task->count, task->first);
+	return NULL;
+}
+
+static void *decode_task(void *arg)
+{
+	struct thread_task *task = arg;
+	task->ok = (mif_loader_decode(task->loader, task->image, task->first,
+				      task->count) == task->count);
+	return NULL;
+}
+
+/*
+* Run <fn> over <nwords> words of <width> bits split into chunks of
+* CHUNK_WORDS, NTHREADS at a time; <whole> describes the whole range and is
+* split per chunk
+*/
+static bool run_chunks(void *(*fn)(void *), const struct thread_task *whole,
+		       long long nwords, unsigned int width)
+{
+	bool ok = true;
+	for (long long base = 0; base < nwords;
+	     base += NTHREADS * CHUNK_WORDS) {
+		pthread_t threads[NTHREADS];
+		struct thread_task tasks[NTHREADS];
+		unsigned int nthreads = 0;
+		for (; nthreads < NTHREADS; ++nthreads) {
+			long long first = base + nthreads * CHUNK_WORDS;
+			if (first >= nwords) {
+				break;
+			}
+			struct thread_task *task = &tasks[nthreads];
+			*task = *whole;
+			task->first = first;
+			task->count = (nwords - first < CHUNK_WORDS
+				       ? nwords - first : CHUNK_WORDS);
+			if (whole->enc != NULL) {
+				task->words = whole->words + first * width / 8;
+				task->dest = whole->dest
+				    + mif_encoder_records_len(whole->enc,
+							      first);
+			} else {
+				task->image = whole->image
+				    + first * ((width + 7) / 8);
+			}
+			if (pthread_create(&threads[nthreads], NULL, fn,
+					   task) != 0) {
+				return false;
+			}
+		}
+		for (unsigned int idx = 0; idx < nthreads; ++idx) {
+			(void)pthread_join(threads[idx], NULL);
+			ok = ok && tasks[idx].ok;
+		}
+	}
+	return ok;
+}
+
+////////////////////////////////// Round trip /////////////////////////////////
+
+static const char *const RADIX_NAMES[] = { "BIN", "OCT", "DEC", "UNS", "HEX" };
+
+static const char *const ORDER_NAMES[] = {
+	"little", "big", "word-swapped", "half-word-swapped"
+};
+
+/*
+* Encode <depth> random words with the given settings, load the text back and
+* compare every word; without ranges, also format the records on several
+* threads and compare them with the streamed ones
+*/
+static void test_round_trip(long long depth, unsigned int width,
+			    enum mif_radix address_radix,
+			    enum mif_radix data_radix,
+			    enum mif_byte_order order,
+			    unsigned int words_per_line, bool compress)
+{
+	struct mif_config config;
+	mif_config_init(&config, depth, width);
+	config.address_radix = address_radix;
+	config.data_radix = data_radix;
+	config.byte_order = order;
+	config.words_per_line = words_per_line;
+	config.compress = compress;
+
+	// Little-endian words with the unused high bits clear; runs of equal
+	// words give ranges something to collapse
+	const size_t word_size = (width + 7) / 8;
+	const size_t image_len = depth * word_size;
+	unsigned char *image = malloc(image_len);
+	unsigned char *input = malloc(image_len);
+	unsigned char *loaded = calloc(image_len, 1);
+	struct text text = { NULL, 0, 0 };
+	if (image == NULL || input == NULL || loaded == NULL) {
+		CHECK(false, "out of memory");
+		goto out;
+	}
+	for (long long idx = 0; idx < depth; ++idx) {
+		unsigned char *word = image + idx * word_size;
+		if (idx > 0 && idx % 16 < 6) {
+			memcpy(word, word - word_size, word_size);
+			continue;
+		}
+		for (size_t byte_idx = 0; byte_idx < word_size; ++byte_idx) {
+			word[byte_idx] = random_byte();
+		}
+		if (width % 8 != 0) {
+			word[word_size - 1] &= (1 << (width % 8)) - 1;
+		}
+	}
+
+	size_t input_len = image_len;
+	if (width % 8 != 0) {
+		input_len = (depth * width + 7) / 8;
+		pack_bits(input, image, depth, width);
+	} else {
+		memcpy(input, image, image_len);
+		CHECK(mif_swap_words(input, depth, width, order),
+		      "width %u, %s", width, ORDER_NAMES[order]);
+	}
+
+	char what[96];
+	(void)snprintf(what, sizeof(what), "width %u, %s/%s, %s, %u per line%s",
+		       width, RADIX_NAMES[address_radix],
+		       RADIX_NAMES[data_radix], ORDER_NAMES[order],
+		       words_per_line, compress ? ", ranges" : "");
+
+	if (!encode_text(&config, input, input_len, &text)) {
+		CHECK(false, "%s: encoding failed", what);
+		goto out;
+	}
+
+	unsigned long error_line = 0;
+	struct mif_loader *loader = mif_loader_open_text(text.data, text.len,
+							 NTHREADS,
+							 &error_line);
+	if (loader == NULL) {
+		CHECK(false, "%s: loading failed at line %lu", what,
+		      error_line);
+		goto out;
+	}
+	CHECK(mif_loader_depth(loader) == depth, "%s", what);
+	CHECK(mif_loader_width(loader) == width, "%s", what);
+	CHECK(mif_loader_is_fixed(loader) == !compress, "%s", what);
+	CHECK(mif_loader_decode(loader, loaded, 0, depth) == depth, "%s",
+	      what);
+	CHECK(memcmp(loaded, image, image_len) == 0, "%s: words differ", what);
+
+	unsigned char word[MIF_MAX_DECIMAL_WIDTH / 8];
+	long long addr = depth / 3;
+	CHECK(mif_loader_read(loader, addr, word)
+	      && memcmp(word, image + addr * word_size, word_size) == 0,
+	      "%s: word %lld", what, addr);
+	CHECK(mif_loader_decode(loader, loaded, depth - 1, 2) == -1,
+	      "%s: range past the depth", what);
+
+	// Decoding is thread-safe: each thread fills its own part
+	memset(loaded, 0, image_len);
+	struct thread_task whole = { .loader = loader, .image = loaded };
+	CHECK(run_chunks(decode_task, &whole, depth, width)
+	      && memcmp(loaded, image, image_len) == 0,
+	      "%s: concurrent decoding", what);
+	mif_loader_close(loader);
+
+	if (compress) {
+		goto out;
+	}
+
+	// So is formatting: the records must match the streamed ones
+	struct mif_encoder *enc = mif_encoder_create(&config);
+	const size_t records_len = mif_encoder_records_len(enc, depth);
+	const size_t header_len = text.len - records_len - strlen(MIF_TRAILER);
+	char *records = malloc(records_len);
+	if (enc != NULL && records != NULL) {
+		whole = (struct thread_task) {
+			.enc = enc, .words = input, .dest = records
+		};
+		CHECK(run_chunks(format_task, &whole, depth, width)
+		      && memcmp(records, text.data + header_len,
+				records_len) == 0,
+		      "%s: concurrent formatting", what);
+	} else {
+		CHECK(false, "%s: out of memory", what);
+	}
+	free(records);
+	mif_encoder_destroy(enc);
+
+ out:
+	free(text.data);
+	free(loaded);
+	free(input);
+	free(image);
+}
+
+static void test_round_trips(void)
+{
+	static const unsigned int widths[] = {
+		1, 5, 8, 12, 16, 24, 32, 40, 64, 96, 128, 200
+	};
+	const long long depth = 1000;	// a short last record on 3 per line
+
+	for (size_t idx = 0; idx < sizeof(widths) / sizeof(widths[0]); ++idx) {
+		unsigned int width = widths[idx];
+		for (int data = MIF_RADIX_BIN; data <= MIF_RADIX_HEX; ++data) {
+			enum mif_radix address = (data + idx) % 5;
+			for (int order = MIF_ORDER_LITTLE;
+			     order <= MIF_ORDER_HALF_WORD_SWAPPED; ++order) {
+				if ((order != MIF_ORDER_LITTLE
+				     && width % 8 != 0)
+				    || (order == MIF_ORDER_WORD_SWAPPED
+					&& width % 32 != 0)
+				    || (order == MIF_ORDER_HALF_WORD_SWAPPED
+					&& width % 16 != 0)) {
+					continue;
+				}
+				test_round_trip(depth, width, address, data,
+						order, 1, false);
+				test_round_trip(depth, width, address, data,
+						order, 3, false);
+				test_round_trip(depth, width, address, data,
+						order, 1, true);
+			}
+		}
+	}
+}
+
+//////////////////////////////// Sparse files /////////////////////////////////
+
+static void test_sparse(void)
+{
+	static const char text[] =
+	    "-- written by hand\n"
+	    "DEPTH = 16;\n"
+	    "WIDTH = 8;\n"
+	    "ADDRESS_RADIX = HEX;\n"
+	    "DATA_RADIX = HEX;\n"
+	    "CONTENT BEGIN\n"
+	    "\t0 : 11;\n"
+	    "\t[2..5] : 22 77;\n"
+	    "\t4 : 33 44; % two words %\n"
+	    "\tA : FF;\n"
+	    "\t3 : 55;\n"
+	    "END;\n";
+	static const unsigned char expected[16] = {
+		0x11, 0, 0x22, 0x55, 0x33, 0x44, 0, 0, 0, 0, 0xff
+	};
+	static const unsigned long lines[16] = {
+		7, 0, 8, 11, 9, 9, 0, 0, 0, 0, 10
+	};
+
+	for (unsigned int jobs = 1; jobs <= NTHREADS; jobs += NTHREADS - 1) {
+		unsigned long error_line = 0;
+		struct mif_loader *loader = mif_loader_open_text(text,
+								 strlen(text),
+								 jobs,
+								 &error_line);
+		if (loader == NULL) {
+			CHECK(false, "loading failed at line %lu", error_line);
+			continue;
+		}
+
+		unsigned char image[16];
+		CHECK(!mif_loader_is_fixed(loader), "sparse file");
+		CHECK(mif_loader_decode(loader, image, 0, 16) == 16
+		      && memcmp(image, expected, 16) == 0, "sparse words");
+		for (long long addr = 0; addr < 16; ++addr) {
+			CHECK(mif_loader_line(loader, addr) == lines[addr],
+			      "line of address %lld", addr);
+		}
+		mif_loader_close(loader);
+	}
+}
+
+/*
+* Many overlapping records in random order, so that indexing is split
+* across threads
+*/
+static void test_overlapping(void)
+{
+	enum { DEPTH = 4096, NRECORDS = 3000 };
+	unsigned char expected[DEPTH] = { 0 };
+	struct text text = { NULL, 0, 0 };
+	char line[64];
+
+	int len = snprintf(line, sizeof(line), "DEPTH = %d;\nWIDTH = 8;\n"
+			   "CONTENT BEGIN\n", DEPTH);
+	bool ok = text_sink(&text, line, len);
+	for (unsigned int idx = 0; idx < NRECORDS && ok; ++idx) {
+		unsigned int first = (random_byte() << 4 | random_byte() >> 4)
+		    % DEPTH;
+		unsigned int count = random_byte() % 40 + 1;
+		if (first + count > DEPTH) {
+			count = DEPTH - first;
+		}
+		unsigned char value = random_byte();
+		len = (count > 1
+		       ? snprintf(line, sizeof(line), "[%X..%X] : %X;\n",
+				  first, first + count - 1, value)
+		       : snprintf(line, sizeof(line), "%X : %X;\n", first,
+				  value));
+		memset(expected + first, value, count);
+		ok = text_sink(&text, line, len);
+	}
+	ok = ok && text_sink(&text, "END;\n", 5);
+	if (!ok) {
+		CHECK(false, "out of memory");
+		free(text.data);
+		return;
+	}
+
+	unsigned long error_line = 0;
+	struct mif_loader *loader = mif_loader_open_text(text.data, text.len,
+							 NTHREADS,
+							 &error_line);
+	if (loader == NULL) {
+		CHECK(false, "loading failed at line %lu", error_line);
+	} else {
+		unsigned char image[DEPTH];
+		CHECK(mif_loader_decode(loader, image, 0, DEPTH) == DEPTH
+		      && memcmp(image, expected, DEPTH) == 0,
+		      "overlapping words");
+		mif_loader_close(loader);
+	}
+	free(text.data);
+}
+
+////////////////////////////// Malformed input ////////////////////////////////
+
+/*
+* Structural errors fail the open at the offending line; bad values are only
+* found when read, and the line of the record is then looked up
+*/
+static void test_malformed(void)
+{
+	static const struct {
+		const char *text;
+		unsigned long line;
+		long long bad_addr;	// -1 if the open fails
+	} cases[] = {
+		{ "DEPTH = 4;\nWIDTH = x;\nCONTENT BEGIN\nEND;\n", 2, -1 },
+		{ "DEPTH = 4;\nWIDTH = 8;\nDATA_RADIX = HEXA;\n"
+		  "CONTENT BEGIN\nEND;\n", 3, -1 },
+		{ "DEPTH = 4;\nWIDTH = 8;\nCONTENT BEGIN\n0 : 12;\n\n4 : 34;\n"
+		  "END;\n", 6, -1 },
+		{ "DEPTH = 4;\nWIDTH = 8;\nCONTENT BEGIN\n[3..1] : 0;\nEND;\n",
+		  4, -1 },
+		{ "DEPTH = 4;\nWIDTH = 8;\nCONTENT BEGIN\n0 : 12;\n1 : ;\n"
+		  "END;\n", 5, -1 },
+		{ "DEPTH = 4;\nWIDTH = 8;\nCONTENT BEGIN\n0 : 12;\n1 : 1G;\n"
+		  "END;\n", 5, 1 },
+		{ "DEPTH = 4;\nWIDTH = 4;\nCONTENT BEGIN\n0 : 1;\n"
+		  "[1..2] : 12;\nEND;\n", 5, 1 },
+	};
+
+	for (size_t idx = 0; idx < sizeof(cases) / sizeof(cases[0]); ++idx) {
+		const char *text = cases[idx].text;
+		unsigned long error_line = 0;
+		errno = 0;
+		struct mif_loader *loader =
+		    mif_loader_open_text(text, strlen(text), 1, &error_line);
+		if (cases[idx].bad_addr < 0) {
+			CHECK(loader == NULL && errno == EINVAL
+			      && error_line == cases[idx].line,
+			      "case %zu: error at line %lu, not %lu", idx,
+			      error_line, cases[idx].line);
+			mif_loader_close(loader);
+			continue;
+		}
+		if (loader == NULL) {
+			CHECK(false, "case %zu: loading failed at line %lu",
+			      idx, error_line);
+			continue;
+		}
+
+		unsigned char image[4];
+		long long bad_addr = mif_loader_decode(loader, image, 0, 4);
+		CHECK(bad_addr == cases[idx].bad_addr && errno == EINVAL
+		      && mif_loader_line(loader, bad_addr) == cases[idx].line,
+		      "case %zu: %lld words decoded", idx, bad_addr);
+		mif_loader_close(loader);
+	}
+
+	// The same for a file of fixed-length records, read without an index
+	struct mif_config config;
+	mif_config_init(&config, 100, 8);
+	unsigned char input[100] = { 0 };
+	struct text text = { NULL, 0, 0 };
+	if (!encode_text(&config, input, sizeof(input), &text)
+	    || !text_sink(&text, "", 1)) {
+		CHECK(false, "encoding failed");
+		free(text.data);
+		return;
+	}
+	--text.len;		// the terminator is only there for strstr
+
+	char *record = strstr(text.data, "39 : 00;");
+	if (record == NULL) {
+		CHECK(false, "no record for address 0x39");
+		free(text.data);
+		return;
+	}
+	record[5] = 'G';
+
+	unsigned long error_line = 0;
+	struct mif_loader *loader = mif_loader_open_text(text.data, text.len, 1,
+							 &error_line);
+	if (loader == NULL) {
+		CHECK(false, "loading failed at line %lu", error_line);
+	} else {
+		unsigned char image[100];
+		errno = 0;
+		CHECK(mif_loader_is_fixed(loader), "fixed-length records");
+		CHECK(mif_loader_decode(loader, image, 0, 100) == 0x39
+		      && errno == EINVAL, "bad fixed-length record");
+		CHECK(mif_loader_line(loader, 0x39)
+		      == line_at(text.data, record - text.data),
+		      "line of the bad record");
+		mif_loader_close(loader);
+	}
+	free(text.data);
+}
+
+int main(void)
+{
+	test_round_trips();
+	test_sparse();
+	test_overlapping();
+	test_malformed();
+
+	if (FAILURES > 0) {
+		fprintf(stderr, "%u checks failed\n", FAILURES);
+		return 1;
+	}
+	return 0;
+}
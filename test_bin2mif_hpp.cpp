@@ -0,0 +1,121 @@
+/*
+* Tests of bin2mif.hpp: the records the wrapper formats itself must match the
+* C encoder's, whole or fed in spans that split words, and load back to the
+* same image. Exits with status 1 if any check fails.
+*/
+
+#include "bin2mif.hpp"
+
+#include <cstdint>		// std::uint64_t
+#include <cstdio>		// std::fprintf
+#include <vector>		// std::vector
+
+namespace {
+
+unsigned int failures = 0;
+
+void check(bool cond, const char *what, unsigned int width)
+{
+	if (!cond) {
+		std::fprintf(stderr, "width %u: %s\n", width, what);
+		++failures;
+	}
+}
+
+std::vector<std::byte> random_image(std::size_t len)
+{
+	std::uint64_t state = 0x9e3779b97f4a7c15 ^ len;
+	std::vector<std::byte> image(len);
+	for (std::size_t idx = 0; idx < len; ++idx) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		// Runs of equal bytes give ranges something to collapse
+		image[idx] = (idx % 64 < 24 ? std::byte{0x5a}
+			      : static_cast<std::byte>(state >> 32));
+	}
+	return image;
+}
+
+bool sink(void *context, const char *data, std::size_t len)
+{
+	static_cast<std::string *>(context)->append(data, len);
+	return true;
+}
+
+/*
+* Output of the C encoder for <depth> words of <width> bits of <image>
+*/
+std::string c_encode(std::span<const std::byte> image, long long depth,
+		     unsigned int width, bool compress)
+{
+	mif_config config;
+	mif_config_init(&config, depth, width);
+	config.compress = compress;
+
+	std::string out;
+	mif_encoder *enc = mif_encoder_create(&config);
+	if (enc == nullptr
+	    || !mif_encoder_write(enc, image.data(), image.size(), sink, &out)
+	    || !mif_encoder_close(enc, sink, &out)) {
+		out.clear();
+	}
+	mif_encoder_destroy(enc);
+	return out;
+}
+
+template <unsigned int Width>
+void test_width()
+{
+	constexpr std::size_t word_size = Width / 8;
+	const long long depth = 777;
+	const std::vector<std::byte> image = random_image(depth * word_size);
+
+	for (bool compress : {false, true}) {
+		const std::string expected = c_encode(image, depth, Width,
+						      compress);
+		check(!expected.empty(), "C encoder", Width);
+		check(bin2mif::to_mif<Width>(image, -1, compress) == expected,
+		      compress ? "to_mif with ranges" : "to_mif", Width);
+
+		// Spans that end inside words
+		bin2mif::encoder<Width> enc(depth, compress);
+		std::string out;
+		std::span<const std::byte> rest(image);
+		for (std::size_t len = 1; !rest.empty(); len = len * 3 + 1) {
+			std::size_t span = std::min(len, rest.size());
+			enc.write(rest.first(span), out);
+			rest = rest.subspan(span);
+		}
+		enc.close(out);
+		check(out == expected, "spans", Width);
+		check(enc.words() == depth, "words", Width);
+	}
+
+	std::string text = bin2mif::to_mif<Width>(image);
+	mif_loader *loader = mif_loader_open_text(text.data(), text.size(), 2,
+						  nullptr);
+	std::vector<std::byte> loaded(image.size());
+	check(loader != nullptr
+	      && mif_loader_decode(loader, loaded.data(), 0, depth) == depth
+	      && loaded == image, "loading back", Width);
+	mif_loader_close(loader);
+}
+
+}				// namespace
+
+int main()
+{
+	test_width<8>();
+	test_width<16>();
+	test_width<32>();
+	test_width<64>();
+	test_width<128>();
+	test_width<1024>();
+
+	if (failures > 0) {
+		std::fprintf(stderr, "%u checks failed\n", failures);
+		return 1;
+	}
+	return 0;
+}